@@ -1,28 +1,134 @@
 #include "qine.h"
 #include <string>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <vector>
 #include <iomanip>
 #include <algorithm>
 #include <math.h>
 #include <assert.h>
+#include <thread>
+#include <atomic>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <map>
+#include <sstream>
+#include <limits.h>
 
 #define MAX_MAP_BRUSHES 32768
 
+// Brightest light a cluster of emitters is written as
+#define LIGHT_MAX_INTENSITY 2000
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
 using namespace std;
 
 void displayHelp();
+double currentTime();
+void filterWorld(qine::qine & qine, int hintSize);
+bool mergeWorld(qine::qine & qine, int hintSize, bool chunked = false, bool verbose = false);
+void mergeAxes(qine::qine & qine, bool verbose);
+int remergeMap(std::string sourcename, std::string mapname, int hintSize, int threads, const double* budgets,
+		int blockSize, int chopSize, bool verbose);
+int runBatch(std::string batchname, int x, int y, int offsetX, int offsetY, int hintSize, int worldX, int worldY, int worldZ, int threads,
+		const double* budgets, int maxLights, int blockSize, int chopSize, bool fillHidden, int canopyBoxes, bool mergeLiquids,
+		int lod, bool clipHull, int regionSize, bool groupRegions, std::string workdir);
+void cancelRun(int sig);
+int convert(int argc, char* argv[], qine::blobCache* cache, std::string workdir);
+int runServer(std::string socketname, int megabytes);
+int runClient(std::string socketname, int argc, char* argv[]);
+int runBenchmark(int size, int runs);
+std::string resolvePath(const std::string & dir, const std::string & name);
+qine::blobCache::blob cachedLevel(qine::blobCache & cache, std::string datname);
+
+// getopt keeps its state in globals, the server parses one request at a time
+static std::mutex s_OptionsMutex;
 
 int main(int argc, char* argv[])
+{
+	// Stop the long stages cleanly, a second signal kills
+	signal(SIGINT, cancelRun);
+	signal(SIGTERM, cancelRun);
+
+	if (argc >= 3 && strcmp(argv[1], "--serve") == 0)
+	{
+		return runServer(argv[2], argc >= 4 ? atoi(argv[3]) : 1024);
+	}
+
+	if (argc >= 3 && strcmp(argv[1], "--connect") == 0)
+	{
+		return runClient(argv[2], argc - 3, argv + 3);
+	}
+
+	if (argc >= 3 && strcmp(argv[1], "--benchmark") == 0)
+	{
+		return runBenchmark(atoi(argv[2]), argc >= 4 ? atoi(argv[3]) : 3);
+	}
+
+	return convert(argc, argv, 0, "");
+}
+
+/*
+ * Converts a world as the command line tells. The server passes its cache
+ * and the directory of the client, relative paths are taken from there.
+ */
+int convert(int argc, char* argv[], qine::blobCache* cache, std::string workdir)
 {
 	std::string mapname, datname;
 
 	int x = 100;
 	int y = 100;
+	int offsetX = 0;
+	int offsetY = 0;
+	int worldX = WORLD_X;
+	int worldY = WORLD_Y;
+	int worldZ = WORLD_Z;
 	int hintSize = 0;
+	int regionSize = 0;
+	bool groupRegions = false;
+	std::string cachename;
+	bool fromCache = false;
+	int threads = std::thread::hardware_concurrency();
+	std::string batchname;
+	double budgets[qine::qine::numStages] = { 0, 0 };
+	int maxLights = 0;
+	std::string previewname;
+	int blockSize = 0;
+	int chopSize = 0;
+	int estimate = 0; // 1 = print, 2 = apply
+	bool fillHidden = false;
+	int canopyBoxes = 0;
+	bool mergeLiquids = false;
+	std::string sourcename;
+	int lod = 1;
+	bool clipHull = false;
+	int chunkedMerge = 0;
+	bool verbose = false;
+
+	static struct option longOptions[] = {
+		{ "cache", required_argument, 0, 'c' },
+		{ "from-cache", no_argument, 0, 'C' },
+		{ "deadline", required_argument, 0, 'T' },
+		{ "blocksize", required_argument, 0, 'B' },
+		{ "chopsize", required_argument, 0, 'K' },
+		{ 0, 0, 0, 0 }
+	};
+
+	std::unique_lock<std::mutex> optionsLock(s_OptionsMutex);
+	optind = 0;
 
 	int c;
-	while ((c = getopt(argc, argv, "x:y:o:i:h:")) != -1)
+	while ((c = getopt_long(argc, argv, "x:y:X:Y:o:i:h:r:gc:Cd:j:b:T:l:p:B:K:eEFt:m:WL:Ps:v", longOptions, 0)) != -1)
 	{
 		switch (c)
 		{
@@ -32,6 +138,12 @@ int main(int argc, char* argv[])
 		case 'y':
 			y = atoi(optarg);
 			break;
+		case 'X':
+			offsetX = atoi(optarg);
+			break;
+		case 'Y':
+			offsetY = atoi(optarg);
+			break;
 		case 'o':
 			mapname = optarg;
 			break;
@@ -41,12 +153,156 @@ int main(int argc, char* argv[])
 		case 'h':
 			hintSize = atoi(optarg);
 			break;
+		case 'r':
+			regionSize = atoi(optarg);
+			break;
+		case 'g':
+			groupRegions = true;
+			break;
+		case 'c':
+			cachename = optarg;
+			break;
+		case 'C':
+			fromCache = true;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'b':
+			batchname = optarg;
+			break;
+		case 'l':
+			maxLights = atoi(optarg);
+			break;
+		case 'p':
+			previewname = optarg;
+			break;
+		case 'B':
+			blockSize = atoi(optarg);
+			break;
+		case 'K':
+			chopSize = atoi(optarg);
+			break;
+		case 'e':
+			estimate = 1;
+			break;
+		case 'E':
+			estimate = 2;
+			break;
+		case 'F':
+			fillHidden = true;
+			break;
+		case 't':
+			canopyBoxes = atoi(optarg);
+			break;
+		case 'm':
+			sourcename = optarg;
+			break;
+		case 'W':
+			mergeLiquids = true;
+			break;
+		case 's':
+			chunkedMerge = atoi(optarg);
+			if (chunkedMerge <= 0)
+			{
+				cout << "--- ERROR: The chunk size of -s should be positive" << endl;
+				return 1;
+			}
+			break;
+		case 'P':
+			clipHull = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'L':
+			lod = atoi(optarg);
+			if (lod != 1 && lod != 2 && lod != 4 && lod != 8)
+			{
+				cout << "--- ERROR: The level of detail should be 1, 2, 4 or 8" << endl;
+				return 1;
+			}
+			break;
+		case 'T':
+		{
+			char stage[16];
+			double seconds;
+			if (sscanf(optarg, "%15[^=]=%lf", stage, &seconds) != 2
+					|| (strcmp(stage, "check") != 0 && strcmp(stage, "merge") != 0))
+			{
+				cout << "--- ERROR: Deadlines should be given as check=seconds or merge=seconds" << endl;
+				return 1;
+			}
+			budgets[strcmp(stage, "check") == 0 ? qine::qine::stageCheck : qine::qine::stageMerge] = seconds;
+			break;
+		}
+		case 'd':
+			if (sscanf(optarg, "%dx%dx%d", &worldX, &worldY, &worldZ) != 3 || worldX < 1 || worldY < 1 || worldZ < 1)
+			{
+				cout << "--- ERROR: World dimensions should be given as XxYxZ, all of them positive" << endl;
+				return 1;
+			}
+			break;
 		default:
 			displayHelp();
 			return 1;
 		}
 	}
 
+	optionsLock.unlock();
+
+	if (workdir.length() > 0)
+	{
+		std::string* paths[] = { &mapname, &datname, &cachename, &batchname, &previewname, &sourcename };
+		for (int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+		{
+			*paths[i] = resolvePath(workdir, *paths[i]);
+		}
+	}
+
+	if (chunkedMerge > 0 && (regionSize > 0 || previewname.length() > 0 || estimate > 0
+			|| cachename.length() > 0 || batchname.length() > 0 || sourcename.length() > 0))
+	{
+		cout << "--- ERROR: -s merges and writes one chunk at a time, it cannot be combined with -r, -p, -e, -c, -b or -m" << endl;
+		return 1;
+	}
+
+	if (batchname.length() > 0 && (previewname.length() > 0 || estimate > 0
+			|| cachename.length() > 0 || fromCache || sourcename.length() > 0))
+	{
+		cout << "--- ERROR: -b converts several worlds to their own maps, it cannot be combined with -p, -e, -E, -c, -C or -m" << endl;
+		return 1;
+	}
+
+	if (batchname.length() > 0)
+	{
+		if (x < 1 || y < 1 || worldZ < 1 || offsetX < 0 || offsetY < 0 || offsetX + x > worldX || offsetY + y > worldY
+				|| worldZ > 32767)
+		{
+			cout << "--- ERROR: The converted area does not fit in the world" << endl;
+			displayHelp();
+			return 1;
+		}
+		return runBatch(batchname, x, y, offsetX, offsetY, hintSize, worldX, worldY, worldZ, threads, budgets, maxLights,
+				blockSize, chopSize, fillHidden, canopyBoxes, mergeLiquids, lod, clipHull, regionSize, groupRegions, workdir);
+	}
+
+	if (sourcename.length() > 0)
+	{
+		if (mapname.length() == 0)
+		{
+			cout << "--- ERROR: You need to specify a output map name" << endl;
+			displayHelp();
+			return 1;
+		}
+		if (regionSize > 0)
+		{
+			cout << "--- ERROR: -m writes a single map, it cannot be split in regions" << endl;
+			return 1;
+		}
+		return remergeMap(sourcename, mapname, hintSize, threads, budgets, blockSize, chopSize, verbose);
+	}
+
 	// Argument requirements
 	if (datname.length() == 0)
 	{
@@ -62,54 +318,179 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	if (x < 1 || y < 1 || worldZ < 1 || offsetX < 0 || offsetY < 0 || offsetX + x > worldX || offsetY + y > worldY
+			|| worldZ > 32767)
+	{
+		cout << "--- ERROR: The converted area does not fit in the world" << endl;
+		displayHelp();
+		return 1;
+	}
+
+
+	if (fromCache && cachename.length() == 0)
+	{
+		cout << "--- ERROR: --from-cache needs a cache file (-c)" << endl;
+		displayHelp();
+		return 1;
+	}
+
 	cout << "Converting world" << endl;
 	cout << "X-Size: " << x << endl;
 	cout << "Y-Size: " << y << endl;
+	cout << "Offset: " << offsetX << ", " << offsetY << endl;
+	cout << "World: " << worldX << "x" << worldY << "x" << worldZ << endl;
 	cout << "Hint size: " << hintSize << endl;
+	if (lod > 1)
+	{
+		cout << "Level of detail: 1/" << lod << endl;
+	}
+	if (chunkedMerge > 0)
+	{
+		cout << "Chunked merge: " << chunkedMerge << "x" << chunkedMerge << " columns (brushes do not cross chunk borders, smooth terrain"
+				<< " can take up to twice as many brushes as without -s)" << endl;
+	}
+	if (regionSize > 0)
+	{
+		cout << "Region size: " << regionSize << (groupRegions ? " (func_groups)" : " (map files)") << endl;
+	}
 	cout << "Input filename: " << datname << endl;
+	if (cachename.length() > 0)
+	{
+		cout << "Cache filename: " << cachename << endl;
+	}
 	cout << "Output filename: " << mapname << endl << endl;
 
 	// Create map object
-	qine::qine qine(datname, x, y, hintSize);
+	qine::qine qine(datname, x, y, hintSize, worldX, worldY, worldZ, offsetX, offsetY, lod);
+	qine.setThreads(threads);
+	qine.setBudget(qine::qine::stageCheck, budgets[qine::qine::stageCheck]);
+	qine.setBudget(qine::qine::stageMerge, budgets[qine::qine::stageMerge]);
+	qine.setMaxLights(maxLights);
+	qine.setBlockSize(blockSize, chopSize);
+	qine.setFillHidden(fillHidden);
+	qine.setCanopyBoxes(canopyBoxes);
+	qine.setMergeLiquids(mergeLiquids);
+	qine.setClipHull(clipHull);
+
+	// The server keeps input files and merged brushes between requests
+	std::string brushKey;
+	if (cache != 0)
+	{
+		qine.setLevelFile(cachedLevel(*cache, datname));
+		if (chunkedMerge == 0)
+		{
+			char key[32];
+			sprintf(key, "%016llx", (unsigned long long)qine.computeCacheKey());
+			brushKey = std::string("brushes:") + key;
+		}
+	}
 
-	// Remove all blocks that we do not want
-	qine.filterBlocks();
+	// Skip the whole analysis pipeline if the cache matches input and options
+	bool cached = false;
+	if (cachename.length() > 0)
+	{
+		cached = qine.loadBrushCache(cachename);
+	}
 
-	if (hintSize > 0)
+	if (!cached && brushKey.length() > 0)
 	{
-		qine.createHints();
+		qine::blobCache::blob brushes = cache->get(brushKey);
+		if (brushes)
+		{
+			cached = qine.readBrushCache(brushes->data(), brushes->size(), "in memory");
+		}
 	}
 
-	// Remove blocks we cannot see or reach
-	qine.checkBlockList();
+	if (fromCache && !cached)
+	{
+		cout << "--- ERROR: No usable brush cache in " << cachename << endl;
+		return 1;
+	}
 
-	if (hintSize > 0)
+	if (!cached)
 	{
-		qine.removeUselessHints();
+		if (!qine.loadWorld())
+		{
+			return 1;
+		}
+
+		filterWorld(qine, hintSize);
+		if (!mergeWorld(qine, hintSize, chunkedMerge > 0, verbose))
+		{
+			return 1;
+		}
+
+		// A cut short merge is not what the options would give
+		if (cachename.length() > 0 && !qine.stageStopped())
+		{
+			qine.saveBrushCache(cachename);
+		}
+
+		if (brushKey.length() > 0 && !qine.stageStopped())
+		{
+			std::string* brushes = new std::string();
+			qine.writeBrushCache(*brushes);
+			cache->put(brushKey, qine::blobCache::blob(brushes));
+		}
 	}
 
-	qine.removeUncheckedBlocks();
-	// Create a list of blocks and merge if possible
-	qine.createBlockList();
+	if (chunkedMerge > 0)
+	{
+		// Nothing is kept after the map is written, so there are no totals
+		if (!qine.createChunkedMapFile(mapname, chunkedMerge))
+		{
+			return 1;
+		}
+	}
+	else
+	{
+		cout << "There is a total of " << qine.blockCount() << " blocks left in the list" << endl;
+	}
+	if (fillHidden && chunkedMerge == 0)
+	{
+		cout << qine.hiddenBlockCount() << " of them are caulk sealing the hidden volume" << endl;
+	}
+	if (clipHull && chunkedMerge == 0)
+	{
+		int clipBlocks = qine.clipBlockCount();
+		cout << clipBlocks << " clip brushes for player collision against "
+				<< qine.blockCount() - clipBlocks << " visual brushes, which stay solid" << endl;
+	}
 
-	int opt;
-	cout << "optimizing X-axis: " << endl;
-	opt = qine.Optimize(optimizeByX);
-	cout << setw(4) << opt << " merged blocks in x-axis" << endl;
+	if (estimate > 0)
+	{
+		qine.estimateCompileCost(estimate == 2);
+	}
 
-	cout << "optimizing Y-axis:" << endl;
-	opt = qine.Optimize(optimizeByY);
-	cout << setw(4) << opt << " merged blocks in y-axis" << endl;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	cout << "Scratch arena peak: " << qine.arenaPeak() / 1024 << " KB, "
+			<< usage.ru_minflt << " minor / " << usage.ru_majflt << " major page faults" << endl;
 
-	cout << "optimizing Z-axis: " << endl;
-	opt = qine.Optimize(optimizeByZ);
-	cout << setw(4) << opt << " merged blocks in z-axis" << endl;
+	if (regionSize > 0)
+	{
+		qine.createRegionMapFiles(mapname, regionSize, groupRegions);
+	}
+	else if (chunkedMerge == 0)
+	{
+		qine.createMapFile(mapname);
+	}
 
-	cout << "There is a total of " << qine.blockCount() << " blocks left in the list" << endl;
+	if (previewname.length() > 0)
+	{
+		qine.createPreviewFile(previewname);
+	}
 
-	qine.createMapFile(mapname);
+	return qine.stageStopped() ? 2 : 0;
+}
 
-	return 0;
+/*
+ * Signal handler, lets the running stage stop at its next progress check
+ */
+void cancelRun(int sig)
+{
+	qine::progress::cancel();
+	signal(sig, SIG_DFL);
 }
 
 void displayHelp()
@@ -117,927 +498,5273 @@ void displayHelp()
 	cout << "Arguments:" << endl;
 	cout << "-x xsize (amount of blocks in x-axis, default 100)" << endl;
 	cout << "-y ysize (amount of blocks in y-axis, default 100)" << endl;
+	cout << "-X xoffset, -Y yoffset (first block of the converted area, default 0)" << endl;
 	cout << "-o outputfile (like mineqraft.map)" << endl;
-	cout << "-i inputfile (like level.dat)" << endl << endl;
+	cout << "-i inputfile (like level.dat)" << endl;
+	cout << "-d world dimensions XxYxZ (default " << WORLD_X << "x" << WORLD_Y << "x" << WORLD_Z << ")" << endl;
+	cout << "-j threads (default one per core)" << endl << endl;
 	cout << "-h hint size (for manual hinting)" << endl << endl;
+	cout << "-r region size (split output in regions of NxN blocks, writes a .regions manifest)" << endl;
+	cout << "-g write regions as func_groups in one map instead of one map per region" << endl << endl;
+	cout << "-c, --cache cachefile (reuse merged brushes if input and options are unchanged)" << endl;
+	cout << "-C, --from-cache (write the map straight from the cache, fail if it is stale)" << endl << endl;
+	cout << "-b batchfile (convert every \"input output\" line, reading, converting and writing overlap)" << endl;
+	cout << "-m source.map (merge the axis aligned brushes of an existing map again, instead of -i)" << endl << endl;
+	cout << "-p preview.ply (also write the textured faces as a binary PLY mesh)" << endl;
+	cout << "-l max lights (cluster torches, glowstone, lava and jack-o-lanterns into at most N lights)" << endl << endl;
+	cout << "-B, --blocksize N (_blocksize of worldspawn), -K, --chopsize N (chopsize of worldspawn)" << endl;
+	cout << "-F fill the hidden volume under the visible blocks with caulk brushes" << endl;
+	cout << "-t boxes (replace the leaves of every tree by at most N boxes per trunk)" << endl;
+	cout << "-W cover water and lava with few boxes textured only at the surface" << endl;
+	cout << "-P add a few large clip brushes over the terrain the player can touch. The terrain" << endl;
+	cout << "   stays solid, so traces test the clip brushes on top of it: this saves no collision" << endl;
+	cout << "   work unless the terrain textures get nonsolid shaders, which are not written" << endl;
+	cout << "-s size (chunked merge: list, merge and write the blocks of size x size columns at a" << endl;
+	cout << "   time. Only the block list is per chunk, the block grids of the area stay loaded." << endl;
+	cout << "   Brushes do not cross chunk borders)" << endl;
+	cout << "-L factor (level of detail 2, 4 or 8, one block per factor^3 blocks for overview maps)" << endl;
+	cout << "-e estimate the BSP leaves and portals for a sweep of hint sizes and blocksizes" << endl;
+	cout << "-E like -e and use the cheapest blocksize" << endl;
+	cout << "-v print the time of every merge axis" << endl << endl;
+	cout << "-T, --deadline stage=seconds (time budget of the check or merge stage)" << endl;
+	cout << "   A stopped flood fill fails the run, a stopped merge writes the best result so far" << endl;
+	cout << "   and exits with 2. SIGINT and SIGTERM stop the running stage the same way." << endl << endl;
+	cout << "--serve socket [megabytes] (keep converting requests from clients, caching input files" << endl;
+	cout << "   and merged brushes in at most megabytes, default 1024)" << endl;
+	cout << "--connect socket arguments (let the server convert with these arguments)" << endl;
+	cout << "--benchmark size [runs] (time the merge of every axis on a synthetic size x size world," << endl;
+	cout << "   best of runs, default 3)" << endl << endl;
 	cout << "Example mineqraft.exe -x 64 -y 64 -i level.dat -o mykewl.map" << endl << endl;
 }
 
-namespace qine {
-
 /*
- * Constructor.
+ * Removes unwanted blocks from a loaded world and creates the hints
  */
-qine::qine(std::string datname, int width, int length, int hintSize)
+void filterWorld(qine::qine & qine, int hintSize)
 {
-	m_OffsetX = 0;
-	m_OffsetY = 0;
-
-	m_Width = width;
-	m_Length = length;
-
-	m_HintSize = hintSize;
+	// Torches are filtered out, so find the lights first
+	qine.collectLights();
 
-	m_Blocks.resize(m_Width);
-	m_TempBlocks.resize(m_Width);
-	m_CheckList.resize(m_Width);
-	m_TextureList.resize(m_Width);
+	// Remove all blocks that we do not want
+	qine.filterBlocks();
 
-	for (int i = 0; i < m_Width; ++i)
+	if (hintSize > 0)
 	{
-		m_Blocks[i].resize(m_Length);
-		m_TempBlocks[i].resize(m_Length);
-		m_CheckList[i].resize(m_Length);
-		m_TextureList.resize(m_Length);
-		for (int j = 0; j < m_Length; ++j)
-		{
-			m_Blocks[i][j].resize(WORLD_Z);
-			m_TempBlocks[i][j].resize(WORLD_Z);
-			m_CheckList[i][j].resize(WORLD_Z);
-			m_TextureList[i][j].resize(WORLD_Z);
-		}
+		qine.createHints();
 	}
+}
 
-	/*m_Blocks = new char[worldSize()];
-	m_TempBlocks = new char[worldSize()];
-	m_CheckList = new char[worldSize()];
-	m_TextureList = new char[worldSize()];*/
-
-
-	int numHintsWidth = ceil(width/hintSize);
-	int numHintsLength = ceil(length/hintSize);
-	int numHintsHeight = ceil(WORLD_Z/hintSize);
-
-	cout << " A " << numHintsWidth << " A "<< numHintsLength << " A "<< numHintsHeight << endl;
-
-    m_Hint3dArray.resize(numHintsWidth);
-    for (int i = 0; i < numHintsWidth; ++i)
+/*
+ * Removes what cannot be seen and merges the rest into brushes, or leaves
+ * the merge to createChunkedMapFile if chunked is set. Returns false if the flood
+ * fill was stopped, a stopped merge keeps the brushes merged so far.
+ */
+bool mergeWorld(qine::qine & qine, int hintSize, bool chunked, bool verbose)
+{
+	// Remove blocks we cannot see or reach
+	if (!qine.checkBlockList())
 	{
-		m_Hint3dArray[i].resize(numHintsLength);
-		for (int j = 0; j < numHintsLength; ++j)
-		{
-			m_Hint3dArray[i][j].resize(numHintsHeight);
-		}
+		cout << "--- ERROR: Stopped before all visible blocks were found" << endl;
+		return false;
 	}
 
-    cout << " A " << m_Hint3dArray[0][0].size() << " A "<< m_Hint3dArray[0].size() << " A "<< m_Hint3dArray.size() << endl;
+	qine.clusterLights();
 
-	for (int i = 0; i < worldSize(); i++) {
-		m_CheckList[i] = 0;
-		m_TextureList[i] = 0;
+	if (hintSize > 0)
+	{
+		qine.removeUselessHints();
 	}
 
-	ifstream file (datname.c_str(), ios::in|ios::binary|ios::ate);
-
-	char* leveldata = new char[worldSize()];
-
-	// Jump to first level data
-	file.seekg(0x47bc, ios::beg);
-	file.read(leveldata, worldSize());
+	qine.removeUncheckedBlocks();
+	// Before the trees and liquids are replaced by boxes
+	qine.createClipHull();
+	qine.simplifyFoliage();
+	qine.mergeLiquids();
 
-	file.close();
+	if (chunked)
+	{
+		return true;
+	}
 
-	// populate world data vector
+	// Create a list of blocks and merge if possible
+	qine.createBlockList();
+	mergeAxes(qine, verbose);
 
-	// Loop z-axis
-	for (int i = 0; i < WORLD_Z; i++)
+	if (qine.stageStopped())
 	{
-		// Loop y-axis
-		for (int j = 0; j < m_Length; j++)
-		{
-			// Loop x-axis
-			for (int k = 0; k < m_Width; k++)
-			{
-				m_Blocks[k][j][i] = getBlockAtXYZ(leveldata, k, j, i);
-			}
-		}
+		cout << "Merging stopped early, keeping the brushes merged so far" << endl;
 	}
+	return true;
 }
 
 /*
- * Destructor
+ * Merges the block list along x, y and z in turn, with the time of every
+ * axis if verbose is set
  */
-qine::~qine()
+void mergeAxes(qine::qine & qine, bool verbose)
 {
-	delete [] m_Blocks;
-	delete [] m_TempBlocks;
-	delete [] m_CheckList;
-	delete [] m_TextureList;
-}
+	const char* axes[] = { "X", "Y", "Z" };
+	const char* names[] = { "x", "y", "z" };
 
-/*
- * Gets block type at x,y,z from supplied array
- */
-char qine::getBlockAtXYZ(char* arr, int x, int y, int z)
-{
-	return arr[x+y*WORLD_X+z*WORLD_X*WORLD_Y];
+	for (int axis = optimizeByX; axis <= optimizeByZ && !qine.stageStopped(); axis++)
+	{
+		cout << "optimizing " << axes[axis] << "-axis: " << endl;
+		double start = currentTime();
+		int opt = qine.Optimize(axis);
+		cout << setw(4) << opt << " merged blocks in " << names[axis] << "-axis";
+		if (verbose)
+		{
+			cout << " (" << currentTime() - start << " s)";
+		}
+		cout << endl;
+	}
 }
 
 /*
- * Sets block type at x,y,z on supplied array
+ * Reads a map written by qine (or edited by hand), puts its brushes back
+ * into a block grid as large as their bounds, merges them again and
+ * writes the result with the rest of the map copied as it was.
  */
-void qine::setBlockAtXYZ(char* arr, int x, int y, int z, char ch)
+int remergeMap(std::string sourcename, std::string mapname, int hintSize, int threads, const double* budgets,
+		int blockSize, int chopSize, bool verbose)
 {
-	arr[x+y*WORLD_X+z*WORLD_X*WORLD_Y] = ch;
-}
+	qine::qine::sourceMap source;
+	if (!qine::qine::readMap(sourcename, source))
+	{
+		return 1;
+	}
 
-/*
- * Removes (set to Air) all blocks not listed in this function
- */
-void qine::filterBlocks()
-{
-	int blocksFiltered = 0;
+	int width = source.hi[0] - source.lo[0];
+	int length = source.hi[1] - source.lo[1];
+	int height = source.hi[2];
 
-	for (int i = 0; i < worldSize(); i++)
+	if (height > 32767)
 	{
-		// create bedrock in the three lowest layers because of problems with lava
-		// TODO: Confirm that this is still a problem or if this can be removed
-		if (i < ((3*(WORLD_X * WORLD_Y)) -1))
-		{
-			m_Blocks[i] = Stone;
-		}
-
-		else if(!(
-				m_Blocks[i] == Stone ||
-				m_Blocks[i] == Grass   ||
-				m_Blocks[i] == Dirt ||
-			 	m_Blocks[i] == Cobblestone ||
-			 	m_Blocks[i] == Bedrock ||
-				m_Blocks[i] == Water ||
-				m_Blocks[i] == StationaryWater ||
-				m_Blocks[i] == Lava ||
-				m_Blocks[i] == StationaryLava ||
-				m_Blocks[i] == Sand ||
-			 	m_Blocks[i] == Gravel ||
-				m_Blocks[i] == GoldOre ||
-				m_Blocks[i] == IronOre ||
-				m_Blocks[i] == CoalOre ||
-				m_Blocks[i] == Wood ||
-				m_Blocks[i] == Leaves ||
-				m_Blocks[i] == Sandstone ||
-				m_Blocks[i] == Glass ||
-				m_Blocks[i] == LapisLazuliOre ||
-				m_Blocks[i] == LapisLazuliBlock ||
-				m_Blocks[i] == MossStone ||
-				m_Blocks[i] == Obsidian ||
-				m_Blocks[i] == DiamondOre ||
-				m_Blocks[i] == Farmland ||
-				m_Blocks[i] == RedstoneOre ||
-				m_Blocks[i] == GlowingRedstoneOre ||
-				m_Blocks[i] == Snow ||
-				m_Blocks[i] == Ice ||
-				m_Blocks[i] == SnowBlock ||
-				m_Blocks[i] == ClayBlock ||
-				m_Blocks[i] == SoulSand ||
-				m_Blocks[i] == GlowstoneBlock
-		)) {
-			if (m_Blocks[i] != Air) blocksFiltered++;
-			m_Blocks[i] = Air;
-		}
-	}
-	cout << dec << blocksFiltered << " unwanted \"blocks\" (like flowers) filtered out (" << 100*blocksFiltered/(worldSize()) << " %)" << endl ;
-}
+		cout << "--- ERROR: The brushes of " << sourcename << " reach too high" << endl;
+		return 1;
+	}
 
-/*
- * Removes all blocks that we cannot see from the given x,y,z position
- * using a flood fill algorithm. Also mark hints for deletion.
- */
-void qine::checkBlockList()
-{
-	int i = 0;
+	cout << "Remerging " << sourcename << ": " << width << "x" << length << "x" << height
+			<< " blocks at " << source.lo[0] << ", " << source.lo[1] << endl;
 
-	list<position> checkList;
+	qine::qine qine(sourcename, width, length, hintSize, width, length, height, source.lo[0], source.lo[1]);
+	qine.setThreads(threads);
+	qine.setBudget(qine::qine::stageMerge, budgets[qine::qine::stageMerge]);
+	qine.setBlockSize(blockSize, chopSize);
 
-	// Choose a good start position for the flood fill
-	int startX = ((m_Width) / 2) + m_OffsetX;
-	int startY = ((m_Length) / 2) + m_OffsetY;
+	qine.rasterizeMap(source);
+	qine.createBlockList();
+	mergeAxes(qine, verbose);
 
-	position startPosition(startX, startY , WORLD_Z - 1, 0, 0);
+	if (qine.stageStopped())
+	{
+		cout << "Merging stopped early, keeping the brushes merged so far" << endl;
+	}
 
-	checkList.push_back(startPosition);
+	cout << "There is a total of " << qine.blockCount() << " blocks left in the list" << endl;
+	qine.createMapFile(mapname);
 
-	while (!checkList.empty()) {
+	return qine.stageStopped() ? 2 : 0;
+}
 
-		// Pop and delete first item
-		position pos = checkList.front();
-		checkList.pop_front();
+/*
+ * A world of a batch on its way through the pipeline
+ */
+struct batchJob {
+	std::string datname;
+	std::string mapname;
+	qine::qine* world;
+	bool ok;
+};
 
-		// Make sure item is in range
-		if (
-				(pos.x - m_OffsetX) < 0 ||
-				pos.x > (WORLD_X - 1) ||
-				pos.x > (m_OffsetX + m_Width - 1) ||
-				(pos.y - m_OffsetY) < 0 ||
-				pos.y > (WORLD_Y - 1) ||
-				pos.y > (m_OffsetY + m_Length - 1) ||
-				pos.z < 0 ||
-				pos.z > (WORLD_Z - 1))
+/*
+ * Stages of a batch run connected by bounded queues, so at most a few
+ * worlds are in memory while the stages work on different worlds.
+ */
+struct batchPipeline {
+	enum { queueSize = 2 };
+	enum stage { Read, Decode, Merge, Write, NumStages };
 
+	batchPipeline() : toDecode(queueSize), toMerge(queueSize), toWrite(queueSize)
+	{
+		for (int i = 0; i < NumStages; i++)
 		{
-			continue;
+			busy[i] = 0;
 		}
+	}
 
-		// Get type and take action accordingly
-		char type = getBlockAtXYZ(m_Blocks, pos.x, pos.y, pos.z);
+	vector<batchJob> jobs;
+	qine::boundedQueue<batchJob*> toDecode;
+	qine::boundedQueue<batchJob*> toMerge;
+	qine::boundedQueue<batchJob*> toWrite;
+	double busy[NumStages]; // seconds spent working in every stage
+	const double* budgets;
 
-		if (!isDetail(type))
-		{
-			markHintForDeletion(pos.x, pos.y, pos.z);
-		}
+	int x, y, offsetX, offsetY, hintSize, worldX, worldY, worldZ, threads, maxLights;
+	int blockSize, chopSize, canopyBoxes, lod, regionSize;
+	bool fillHidden, mergeLiquids, clipHull, groupRegions;
+};
 
-		if ((isSolid(type))
-		//Only tex water that connects with air
-		|| ((type == Water || type == StationaryWater
-				|| type == Lava || type == StationaryLava) && pos.lastType == Air))
-		{
-			int tmp = getBlockAtXYZ(m_TextureList, pos.x, pos.y, pos.z);
-			tmp |= pos.direction;
-			setBlockAtXYZ(m_TextureList, pos.x, pos.y, pos.z, tmp);
-		}
+static void readStage(batchPipeline* p)
+{
+	for (int i = 0; i < p->jobs.size(); i++)
+	{
+		batchJob & job = p->jobs[i];
+		double start = currentTime();
+
+		job.world = new qine::qine(job.datname, p->x, p->y, p->hintSize, p->worldX, p->worldY, p->worldZ,
+				p->offsetX, p->offsetY, p->lod);
+		job.world->setThreads(p->threads);
+		job.world->setBudget(qine::qine::stageCheck, p->budgets[qine::qine::stageCheck]);
+		job.world->setBudget(qine::qine::stageMerge, p->budgets[qine::qine::stageMerge]);
+		job.world->setMaxLights(p->maxLights);
+		job.world->setBlockSize(p->blockSize, p->chopSize);
+		job.world->setFillHidden(p->fillHidden);
+		job.world->setCanopyBoxes(p->canopyBoxes);
+		job.world->setMergeLiquids(p->mergeLiquids);
+		job.world->setClipHull(p->clipHull);
+		job.ok = job.world->readLevel();
+
+		p->busy[batchPipeline::Read] += currentTime() - start;
+		p->toDecode.push(&job);
+	}
+	p->toDecode.close();
+}
 
-
-		if (getBlockAtXYZ(m_CheckList, pos.x, pos.y, pos.z) == 0)
+static void decodeStage(batchPipeline* p)
+{
+	batchJob* job;
+	while (p->toDecode.pop(job))
+	{
+		double start = currentTime();
+		if (job->ok)
 		{
-			setBlockAtXYZ(m_CheckList, pos.x, pos.y, pos.z, 1);
-			if (!isDetail(type))
-			{
-				checkList.push_back(position(pos.x + 1, pos.y, pos.z, xm, type));
-				checkList.push_back(position(pos.x - 1, pos.y, pos.z, xp, type));
-				checkList.push_back(position(pos.x, pos.y + 1, pos.z, ym, type));
-				checkList.push_back(position(pos.x, pos.y - 1, pos.z, yp, type));
-				checkList.push_back(position(pos.x, pos.y, pos.z + 1, zm, type));
-				checkList.push_back(position(pos.x, pos.y, pos.z - 1, zp, type));
-			}
+			job->world->decodeLevel();
+			filterWorld(*job->world, p->hintSize);
 		}
+		p->busy[batchPipeline::Decode] += currentTime() - start;
+		p->toMerge.push(job);
 	}
+	p->toMerge.close();
 }
 
-/*
- * Returns true if the block type is a solid
- */
-bool qine::isSolid(int type)
+static void mergeStage(batchPipeline* p)
 {
-	return !(type == Air ||
-			type == Water ||
-			type == StationaryWater ||
-			type == Lava ||
-			type == StationaryLava
-			);
+	batchJob* job;
+	while (p->toMerge.pop(job))
+	{
+		double start = currentTime();
+		if (job->ok)
+		{
+			job->ok = mergeWorld(*job->world, p->hintSize);
+		}
+		p->busy[batchPipeline::Merge] += currentTime() - start;
+		p->toWrite.push(job);
+	}
+	p->toWrite.close();
 }
 
-/*
- * Returns true if the block type should be a detail brush
- */
-bool qine::isDetail(int type)
+static void writeStage(batchPipeline* p)
 {
-	return !(type == Air ||
-			type == Water ||
-			type == StationaryWater ||
-			type == Lava ||
-			type == StationaryLava ||
-			type == Wood || // To be able to make them detail
-			type == Leaves
-			);
+	batchJob* job;
+	while (p->toWrite.pop(job))
+	{
+		double start = currentTime();
+		if (job->ok && p->regionSize > 0)
+		{
+			job->world->createRegionMapFiles(job->mapname, p->regionSize, p->groupRegions);
+		}
+		else if (job->ok)
+		{
+			job->world->createMapFile(job->mapname);
+		}
+		delete job->world;
+		job->world = 0;
+		p->busy[batchPipeline::Write] += currentTime() - start;
+	}
 }
 
-
 /*
- * Sets all the blocks that are not in m_Checklist to Air
+ * Converts every "input output" pair of the batch file. Reading, decoding,
+ * merging and writing run on their own threads so the next world is read
+ * while the current one is merged and the previous one is written.
  */
-void qine::removeUncheckedBlocks()
+int runBatch(std::string batchname, int x, int y, int offsetX, int offsetY, int hintSize, int worldX, int worldY, int worldZ, int threads,
+		const double* budgets, int maxLights, int blockSize, int chopSize, bool fillHidden, int canopyBoxes, bool mergeLiquids,
+		int lod, bool clipHull, int regionSize, bool groupRegions, std::string workdir)
 {
-	int numBlocks = 0;
+	batchPipeline p;
+	p.x = x;
+	p.y = y;
+	p.offsetX = offsetX;
+	p.offsetY = offsetY;
+	p.hintSize = hintSize;
+	p.worldX = worldX;
+	p.worldY = worldY;
+	p.worldZ = worldZ;
+	p.threads = threads;
+	p.budgets = budgets;
+	p.maxLights = maxLights;
+	p.blockSize = blockSize;
+	p.chopSize = chopSize;
+	p.fillHidden = fillHidden;
+	p.canopyBoxes = canopyBoxes;
+	p.mergeLiquids = mergeLiquids;
+	p.lod = lod;
+	p.clipHull = clipHull;
+	p.regionSize = regionSize;
+	p.groupRegions = groupRegions;
+
+	ifstream batch(batchname.c_str());
+	if (!batch)
+	{
+		cout << "--- ERROR: Could not open batch file " << batchname << endl;
+		return 1;
+	}
 
-	for (int i = 0; i < worldSize(); i++) {
-		if (m_CheckList[i] == 0) {
-			m_Blocks[i] = 0;
-			numBlocks++;
-		}
+	batchJob job;
+	job.world = 0;
+	job.ok = false;
+	while (batch >> job.datname >> job.mapname)
+	{
+		job.datname = resolvePath(workdir, job.datname);
+		job.mapname = resolvePath(workdir, job.mapname);
+		p.jobs.push_back(job);
+	}
+
+	if (p.jobs.size() == 0)
+	{
+		cout << "--- ERROR: There are no worlds in " << batchname << endl;
+		return 1;
+	}
+
+	cout << "Converting " << p.jobs.size() << " worlds from " << batchname << endl << endl;
+
+	double start = currentTime();
+
+	std::thread reader(readStage, &p);
+	std::thread decoder(decodeStage, &p);
+	std::thread merger(mergeStage, &p);
+	writeStage(&p);
+
+	reader.join();
+	decoder.join();
+	merger.join();
+
+	int failed = 0;
+	for (int i = 0; i < p.jobs.size(); i++)
+	{
+		failed += p.jobs[i].ok ? 0 : 1;
 	}
+
+	cout << endl << p.jobs.size() - failed << " of " << p.jobs.size() << " worlds converted in "
+			<< currentTime() - start << " s (read " << p.busy[batchPipeline::Read]
+			<< " s, decode " << p.busy[batchPipeline::Decode]
+			<< " s, merge " << p.busy[batchPipeline::Merge]
+			<< " s, write " << p.busy[batchPipeline::Write] << " s)" << endl;
+
+	return failed > 0 ? 1 : 0;
 }
 
 /*
- * Returns the volume (in blocks) of the world
+ * Returns name relative to dir, unless it is empty or absolute
  */
-int qine::worldSize()
+std::string resolvePath(const std::string & dir, const std::string & name)
 {
-	return WORLD_X*WORLD_Y*WORLD_Z;
+	if (dir.length() == 0 || name.length() == 0 || name[0] == '/')
+	{
+		return name;
+	}
+	return dir + "/" + name;
 }
 
 /*
- * Creates a list of blocks
+ * Returns the input file from the server cache, reading it if it is not
+ * there or changed on disk. Returns nothing if it cannot be read, so the
+ * conversion reports the error.
  */
-int qine::createBlockList()
+qine::blobCache::blob cachedLevel(qine::blobCache & cache, std::string datname)
 {
-	int mergedBlocks = 0;
-	char ch;
-	char tex;
+	struct stat st;
+	if (stat(datname.c_str(), &st) != 0)
+	{
+		return qine::blobCache::blob();
+	}
 
-	ch = getBlockAtXYZ(m_Blocks, 0,0,0);
-	tex = getBlockAtXYZ(m_TextureList, 0,0,0);
-	mapBlock currentMapBlock;
+	char stamp[64];
+	sprintf(stamp, ":%lld:%lld", (long long)st.st_size, (long long)st.st_mtime);
+	std::string key = "level:" + datname + stamp;
 
-	int numblocks = 0;
-	for (int p = 0; p < worldSize(); p++) {
-		if (m_Blocks[p] != 0)
-			numblocks++;
+	qine::blobCache::blob level = cache.get(key);
+	if (level)
+	{
+		return level;
 	}
-	cout << "There are " << numblocks << " blocks in the list" <<  endl;
 
-	// Loop z-axis
-	for (int i = 0; i < WORLD_Z; i++)
+	ifstream file (datname.c_str(), ios::in|ios::binary);
+	if (!file)
 	{
-		// Loop y-axis
-		for (int j = m_OffsetY; j < m_Length; j++)
-		{
-			// Loop x-axis
-			for (int k = m_OffsetX; k < m_Width; k++)
-			{
-				ch = getBlockAtXYZ(m_Blocks, k, j, i);
-				tex = getBlockAtXYZ(m_TextureList, k, j, i);
-
-				currentMapBlock.blck.x = k;
-				currentMapBlock.blck.y = j;
-				currentMapBlock.blck.z = i;
-				currentMapBlock.blck.width = 1;
-				currentMapBlock.blck.type = ch;
-				currentMapBlock.texturing = tex;
-				if (currentMapBlock.blck.type != Air) {
-					m_BlockCollection.push_back(currentMapBlock);
-				}
-			}
-		}
+		return level;
 	}
-	return mergedBlocks;
+
+	std::string* data = new std::string((size_t)st.st_size, '\0');
+	file.read(&(*data)[0], data->size());
+	data->resize(file.gcount());
+
+	level = qine::blobCache::blob(data);
+	cache.put(key, level);
+	return level;
 }
 
-void qine::createHints()
+/*
+ * Reads or writes all of n bytes on a socket
+ */
+static bool readAll(int fd, void* data, size_t n)
 {
-	cout << "Creating hints" << endl;
-
-	// Loop z-axis
-	for (int z = 0; z < m_Hint3dArray[0][0].size(); z++)
+	char* p = (char*)data;
+	while (n > 0)
 	{
-		// Loop y-axis
-		for (int y = 0; y < m_Hint3dArray[0].size(); y++)
-		{
-			// Loop x-axis
-			for (int x = 0; x < m_Hint3dArray.size(); x++)
-			{
-				m_Hint3dArray[x][y][z].x = x * m_HintSize;
-				m_Hint3dArray[x][y][z].y = y * m_HintSize;
-				m_Hint3dArray[x][y][z].z = z * m_HintSize;
-
-				if (x * m_HintSize + m_HintSize <= m_Width)
-				{
-					m_Hint3dArray[x][y][z].width = m_HintSize;
-				}
-				else
-				{
-					m_Hint3dArray[x][y][z].width = m_Width - x;
-				}
-
-				if (y * m_HintSize + m_HintSize <= m_Length)
-				{
-					m_Hint3dArray[x][y][z].length = m_HintSize;
-				}
-				else
-				{
-					m_Hint3dArray[x][y][z].length = m_Length - y;
-				}
-
-				m_Hint3dArray[x][y][z].height = m_HintSize;
-			}
-		}
+		ssize_t r = recv(fd, p, n, 0);
+		if (r <= 0) return false;
+		p += r;
+		n -= r;
 	}
-
-	cout << "Creating hints done" << endl;
+	return true;
 }
 
-void qine::markHintForDeletion(int x, int y, int z)
+static bool writeAll(int fd, const void* data, size_t n)
 {
-	// Compare to the correct hint
-	int hintX = floor(x / m_HintSize);
-	int hintY = floor(y / m_HintSize);
-
-	// TODO: Make this properly instead of trial and error
-	int hintZ = floor((z+1) / m_HintSize);
+	const char* p = (const char*)data;
+	while (n > 0)
+	{
+		ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+		if (r <= 0) return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
 
-	m_Hint3dArray[hintX][hintY][hintZ].markedForDeletion = true;
+/*
+ * Strings on the socket are a 32 bit length followed by the bytes
+ */
+static bool readString(int fd, std::string & s)
+{
+	uint32_t n;
+	if (!readAll(fd, &n, sizeof(n)) || n > 65536) return false;
+	s.resize(n);
+	return n == 0 || readAll(fd, &s[0], n);
 }
 
-void qine::removeUselessHints()
+static bool writeString(int fd, const std::string & s)
 {
-	cout << "Removing useless hints" << endl;
+	uint32_t n = s.length();
+	return writeAll(fd, &n, sizeof(n)) && writeAll(fd, s.data(), n);
+}
 
-	bool px, nx, py, ny, pz, nz;
+/*
+ * Runs one request of a client: its directory, the number of arguments
+ * and the arguments. Sends back the exit code of the conversion.
+ */
+static void serveClient(int fd, qine::blobCache* cache, std::atomic<int>* running)
+{
+	std::string workdir;
+	uint32_t argc = 0;
 
-	for (int z = 0; z < m_Hint3dArray[0][0].size(); z++)
+	if (readString(fd, workdir) && readAll(fd, &argc, sizeof(argc)) && argc < 256)
 	{
-		for (int y = 0; y < m_Hint3dArray[0].size(); y++)
+		vector<std::string> args(argc + 1, "qine");
+		bool ok = true;
+		for (int i = 1; i <= argc && ok; i++)
 		{
-			for (int x = 0; x < m_Hint3dArray.size(); x++)
-			{
-				px = false;
-				nx = false;
-				py = false;
-				ny = false;
-				pz = false;
-				nz = false;
-				// Check surrounding blocks
-
-				// +x
-				if ((x == (m_Hint3dArray.size() - 1))
-						|| !m_Hint3dArray[x + 1][y][z].markedForDeletion)
-				{
-					px = true;
-				}
-
-				// -x
-				if (x == 0 || !m_Hint3dArray[x - 1][y][z].markedForDeletion)
-				{
-					nx = true;
-				}
-
-				// +y
-				if ((y == (m_Hint3dArray.size() - 1))
-						|| !m_Hint3dArray[x][y + 1][z].markedForDeletion)
-				{
-					py = true;
-				}
-
-				// -y
-				if (y == 0 || !m_Hint3dArray[x][y - 1][z].markedForDeletion)
-				{
-					ny = true;
-				}
-
-				// +z
-				if ((z == (m_Hint3dArray.size() - 1))
-						|| !m_Hint3dArray[x][y][z + 1].markedForDeletion)
-				{
-					pz = true;
-				}
-
-				// -z
-				if (z == 0 || !m_Hint3dArray[x][y][z - 1].markedForDeletion)
-				{
-					nz = true;
-				}
-
-				if (px && nx && py && ny && pz && nz)
-				{
-					m_Hint3dArray[x][y][z].markedForDeletion2 = true;
-				}
-			}
+			ok = readString(fd, args[i]);
 		}
-	}
-}
-
-void qine::MergeHints()
-{
-	// Merging hints does not need to worry about texturing
-
-	hintBrush currentHint;
 
-	// merge x-axis
-	for (int z = 0; z < m_Hint3dArray.size[0][0]() ; z++)
-	{
-		for (int y = 0; y < m_Hint3dArray.size[0]() ; y++)
+		if (ok)
 		{
-			for (int x = 0; x < m_Hint3dArray.size() ; x++)
+			vector<char*> argv;
+			for (int i = 0; i < args.size(); i++)
 			{
-				if (x == 0)
-				{
-					currentHint = m_Hint3dArray[x][y][z];
-				}
-				else
-				{
-					if (!m_Hint3dArray[x][y][z].markedForDeletion &&
-							!m_Hint3dArray[x][y][z].markedForDeletion2)
-					{
-						currentHint.width += m_HintSize;
-						m_Hint3dArray[x][y][z].markedForDeletion = true;
-					}
-					else
-					{
-						currentHint = m_Hint3dArray[x][y][z];
-					}
-				}
+				argv.push_back(&args[i][0]);
 			}
+			argv.push_back(0);
+
+			double start = currentTime();
+			int32_t code = convert(argv.size() - 1, &argv[0], cache, workdir);
+			cout << "Request done with " << code << " in " << currentTime() - start << " s" << endl;
+			cache->print();
+
+			writeAll(fd, &code, sizeof(code));
 		}
 	}
 
+	close(fd);
+	(*running)--;
 }
 
-int qine::Optimize(int direction)
+/*
+ * Accepts clients on a Unix domain socket and converts the request of
+ * every client on its own thread, until SIGINT or SIGTERM. Input files
+ * and merged brushes stay in a cache of at most megabytes, so asking for
+ * another part of a world or the same world again skips reading it, and
+ * asking again with the same options skips the analysis too.
+ */
+int runServer(std::string socketname, int megabytes)
 {
-	int textureMask;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 
-	int merged = 0;
-	int added = 0;
-	bool mergableBlock;
-
-	vector<mapBlock> tempMapBlockCollection;
-	vector<int> markedForDeletion;
-	mapBlock currentMapBlock;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
 
-	switch(direction)
+	if (fd < 0 || socketname.length() >= sizeof(addr.sun_path))
 	{
-	case optimizeByX:
-		textureMask = 0x33;
-		sort (m_BlockCollection.begin(), m_BlockCollection.end() , mapBlockComparatorX);
-		break;
-	case optimizeByY:
-		textureMask = 0x0F;
-		sort (m_BlockCollection.begin(), m_BlockCollection.end() , mapBlockComparatorY);
-		break;
-	case optimizeByZ:
-		textureMask = 0x3C;
-		sort (m_BlockCollection.begin(), m_BlockCollection.end() , mapBlockComparatorZ);
-		break;
+		cout << "--- ERROR: Could not create socket " << socketname << endl;
+		return 1;
 	}
 
-	while (!m_BlockCollection.empty()) {
+	strcpy(addr.sun_path, socketname.c_str());
+	unlink(socketname.c_str());
 
-		// Take out the first block
-		currentMapBlock = m_BlockCollection.front();
-		m_BlockCollection.erase(m_BlockCollection.begin());
-		added = 0;
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+	{
+		cout << "--- ERROR: Could not listen on " << socketname << endl;
+		close(fd);
+		return 1;
+	}
 
-		// Check all the objects for the one you want
-		for (int i = 0; i < m_BlockCollection.size(); i++)
-		{
-			mergableBlock = false;
+	qine::blobCache cache((size_t)max(1, megabytes) * 1024 * 1024);
+	std::atomic<int> running(0);
 
-			// Block suitable for merge
-			switch(direction)
-				{
-				case optimizeByX:
-					if (
-										(m_BlockCollection.at(i).blck.x == currentMapBlock.blck.x + 1 + added) &&
-										(m_BlockCollection.at(i).blck.y == currentMapBlock.blck.y) &&
-										(m_BlockCollection.at(i).blck.z == (currentMapBlock.blck.z)) &&
-										(m_BlockCollection.at(i).blck.type == currentMapBlock.blck.type) &&
-										((m_BlockCollection.at(i).texturing & 0x33) == (currentMapBlock.texturing & 0x33)) &&
-										(m_BlockCollection.at(i).blck.height == currentMapBlock.blck.height) &&
-										(m_BlockCollection.at(i).blck.length == currentMapBlock.blck.length))
-								{
-						currentMapBlock.blck.width++;
-						mergableBlock = true;
-								}
-					break;
-				case optimizeByY:
-					if ( (m_BlockCollection.at(i).blck.x == currentMapBlock.blck.x) &&
-										(m_BlockCollection.at(i).blck.y == currentMapBlock.blck.y + 1 + added) &&
-										(m_BlockCollection.at(i).blck.z == (currentMapBlock.blck.z)) &&
-										(m_BlockCollection.at(i).blck.type == currentMapBlock.blck.type) &&
-										((m_BlockCollection.at(i).texturing & 0xF) == (currentMapBlock.texturing & 0xF)) &&
-										(m_BlockCollection.at(i).blck.height == currentMapBlock.blck.height) &&
-										(m_BlockCollection.at(i).blck.width == currentMapBlock.blck.width)
-								) {
-						currentMapBlock.blck.length++;
-						mergableBlock = true;
-					}
+	cout << "Listening on " << socketname << " with a " << max(1, megabytes) << " MB cache" << endl;
 
-					break;
-				case optimizeByZ:
-					if ( (m_BlockCollection.at(i).blck.x == currentMapBlock.blck.x) &&
-										(m_BlockCollection.at(i).blck.y == currentMapBlock.blck.y) &&
-										(m_BlockCollection.at(i).blck.z == (currentMapBlock.blck.z -1 - added)) &&
-										(m_BlockCollection.at(i).blck.type == currentMapBlock.blck.type) &&
-										((m_BlockCollection.at(i).texturing & 0x3C) == (currentMapBlock.texturing & 0x3C)) &&
-										(m_BlockCollection.at(i).blck.width == currentMapBlock.blck.width) &&
-										(m_BlockCollection.at(i).blck.length == currentMapBlock.blck.length))
-								{
-						currentMapBlock.blck.height++;
-						mergableBlock = true;
-								}
-
-					break;
-				}
+	while (!qine::progress::cancelled())
+	{
+		struct pollfd p;
+		p.fd = fd;
+		p.events = POLLIN;
 
-			if (mergableBlock)
-			{
-					currentMapBlock.texturing |= m_BlockCollection.at(i).texturing;
-					added++;
-					merged++;
-					markedForDeletion.push_back(i);
-			}
+		if (poll(&p, 1, 250) <= 0)
+		{
+			continue;
 		}
 
-		// delete the marked blocks
-		while (!markedForDeletion.empty()) {
-			m_BlockCollection.erase(m_BlockCollection.begin() + markedForDeletion.back());
-			markedForDeletion.pop_back();
+		int client = accept(fd, 0, 0);
+		if (client < 0)
+		{
+			continue;
 		}
-		markedForDeletion.clear();
-		tempMapBlockCollection.push_back(currentMapBlock);
+
+		running++;
+		std::thread(serveClient, client, &cache, &running).detach();
 	}
 
-	m_BlockCollection = tempMapBlockCollection;
-	return merged;
+	close(fd);
+	unlink(socketname.c_str());
+
+	// The running requests see the cancel and stop at their next check
+	while (running > 0)
+	{
+		usleep(10000);
+	}
+
+	cout << "Server stopped" << endl;
+	return 0;
 }
 
 /*
- * Creates a map file from the created collection of blocks.
+ * Sends the arguments to the server at socketname and returns the exit
+ * code of the conversion there. The output stays on the server.
  */
-void qine::createMapFile(std::string mapname)
+int runClient(std::string socketname, int argc, char* argv[])
 {
-	if (m_BlockCollection.size() == 0)
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketname.c_str(), sizeof(addr.sun_path) - 1);
+
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
 	{
-		cout << "--- ERROR: There are no blocks in the collection" << endl;
-		return;
+		cout << "--- ERROR: Could not connect to " << socketname << endl;
+		if (fd >= 0) close(fd);
+		return 1;
 	}
 
-	cout << "Writing map file..." << endl;
+	char workdir[4096];
+	uint32_t n = argc;
+	bool ok = getcwd(workdir, sizeof(workdir)) != 0 && writeString(fd, workdir) && writeAll(fd, &n, sizeof(n));
+	for (int i = 0; i < argc && ok; i++)
+	{
+		ok = writeString(fd, argv[i]);
+	}
 
-	m_OutFile.open(mapname.c_str());
-	m_OutFile << "{" << endl << "\"classname\" \"worldspawn\"" << endl;
+	int32_t code = 1;
+	if (!ok || !readAll(fd, &code, sizeof(code)))
+	{
+		cout << "--- ERROR: The server at " << socketname << " did not answer" << endl;
+		code = 1;
+	}
 
-	// TODO: Add options for custom blocksize and chopsize
-	// m_OutFile << "\"_blocksize\" \"4096 4096 4096\"" << endl;
-	// m_OutFile << "\"_blocksize\" \"32768 32768 32768\"" << endl;
-	// m_OutFile << "\"chopsize\" \"4096\"" << endl;
+	close(fd);
+	return code;
+}
 
-	for (int i = 0; i <  m_BlockCollection.size(); i++)
+/*
+ * Returns a monotonic time in seconds, for timing the stages
+ */
+/*
+ * Builds a world of size x size columns of rolling hills, stone under
+ * dirt under grass, and times the merge of every axis on it. The world
+ * is the same on every run and machine, so the times can be compared.
+ */
+int runBenchmark(int size, int runs)
+{
+	if (size < 1 || runs < 1)
 	{
-		createBrush( m_BlockCollection[i].blck.x,
-				 m_BlockCollection[i].blck.y,
-				 m_BlockCollection[i].blck.z,
-				 m_BlockCollection[i].blck.width,
-				 m_BlockCollection[i].blck.length,
-				 m_BlockCollection[i].blck.height,
-				 m_BlockCollection[i].blck.type,
-				 m_BlockCollection[i].texturing);
+		cout << "--- ERROR: The benchmark size and runs should be positive" << endl;
+		return 1;
 	}
 
-	cout << "brushes done" << endl;
-
-	for (int z = 0; z < m_Hint3dArray[0][0].size(); z++)
+	std::string* data = new std::string(0x47bc + (size_t)size * size * WORLD_Z, '\0');
+	for (int y = 0; y < size; y++)
 	{
-		for (int y = 0; y < m_Hint3dArray[0].size(); y++)
+		for (int x = 0; x < size; x++)
 		{
-			for (int x = 0; x < m_Hint3dArray.size(); x++)
+			int height = (int)(24 + 6 * sin(x / 13.0) + 5 * cos(y / 17.0));
+			for (int z = 0; z < height; z++)
 			{
-				if (!m_Hint3dArray[x][y][z].markedForDeletion
-						&& !m_Hint3dArray[x][y][z].markedForDeletion2)
-				{
-				createBrush(
-						m_Hint3dArray[x][y][z].x,
-						m_Hint3dArray[x][y][z].y,
-						m_Hint3dArray[x][y][z].z,
-						m_Hint3dArray[x][y][z].width,
-						m_Hint3dArray[x][y][z].length,
-						m_Hint3dArray[x][y][z].height,
-								0xFFFF,
-								0xFF // all sides textured on hints
-								);
-				}
+				char type = (z < height - 3) ? 1 : (z < height - 1) ? 3 : 2;
+				(*data)[0x47bc + ((size_t)z * size + y) * size + x] = type;
 			}
 		}
 	}
+	qine::blobCache::blob level(data);
 
-	// TODO: Add all entities such as flowers.
-	m_OutFile << "}" << endl;
-	m_OutFile.close();
-}
+	const char* names[] = { "x", "y", "z" };
+	double best[3] = { 0, 0, 0 };
+	int merged[3] = { 0, 0, 0 };
 
-/*
- * Write one brush to the file.
- */
-void qine::createBrush(int x, int y, int z, int length, int y_length, int height, int type, int texturing)
-{
-	int brushSize = 64;
-	int blockflags = 0;
+	for (int run = 0; run < runs; run++)
+	{
+		qine::qine qine("benchmark", size, size, 0, size, size, WORLD_Z);
+		qine.setThreads(std::thread::hardware_concurrency());
+		qine.setLevelFile(level);
 
-	string xp_tex;
-	string xn_tex;
-	string yp_tex;
-	string yn_tex;
-	string zp_tex;
-	string zn_tex;
+		qine.loadWorld();
+		filterWorld(qine, 0);
+		if (!qine.checkBlockList())
+		{
+			return 1;
+		}
+		qine.removeUncheckedBlocks();
+		qine.createBlockList();
+
+		for (int axis = optimizeByX; axis <= optimizeByZ; axis++)
+		{
+			double start = currentTime();
+			merged[axis] = qine.Optimize(axis);
+			double time = currentTime() - start;
+			if (run == 0 || time < best[axis])
+			{
+				best[axis] = time;
+			}
+		}
+	}
+
+	cout << "Merge of a " << size << "x" << size << "x" << WORLD_Z << " world, best of " << runs << " runs:" << endl;
+	for (int axis = optimizeByX; axis <= optimizeByZ; axis++)
+	{
+		cout << names[axis] << "-axis: " << setw(8) << merged[axis] << " merged blocks in " << best[axis] << " s" << endl;
+	}
+	return 0;
+}
+
+double currentTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+namespace qine {
+
+/*
+ * 64 bit FNV-1a of size bytes, continuing from hash.
+ */
+static uint64_t hashBytes(uint64_t hash, const void* data, int size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+
+	for (int i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+/*
+ * Per axis constants for the merge kernels. The position along the axis
+ * grows in the direction blocks are merged in, so it is -z for the z-axis
+ * where blocks grow downwards from their top. The keys pack everything
+ * that has to be the same for two blocks to be merged.
+ */
+static uint64_t packCoordinates(int a, int b)
+{
+	return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+}
+
+static uint64_t packFootprint(int extentA, int extentB, int type, int texturing)
+{
+	return ((uint64_t)(extentA & 0xFFFFF) << 40) | ((uint64_t)(extentB & 0xFFFFF) << 20)
+			| ((uint64_t)(type & 0x3FFF) << 6) | (texturing & 0x3F);
+}
+
+/*
+ * Sum of the cells in any box of a grid in constant time, from the sums
+ * of all boxes that start at the origin.
+ */
+struct volumeSum {
+	int sizeX;
+	int sizeY;
+	int sizeZ;
+	vector<int> sums; // (sizeX + 1) * (sizeY + 1) * (sizeZ + 1), zero on the low faces
+
+	volumeSum(int sizeX, int sizeY, int sizeZ, const unsigned char* cells) :
+		sizeX(sizeX), sizeY(sizeY), sizeZ(sizeZ),
+		sums((size_t)(sizeX + 1) * (sizeY + 1) * (sizeZ + 1), 0)
+	{
+		for (int z = 0; z < sizeZ; z++)
+		{
+			for (int y = 0; y < sizeY; y++)
+			{
+				for (int x = 0; x < sizeX; x++)
+				{
+					sums[index(x + 1, y + 1, z + 1)] = cells[((size_t)z * sizeY + y) * sizeX + x]
+							+ sums[index(x, y + 1, z + 1)] + sums[index(x + 1, y, z + 1)] + sums[index(x + 1, y + 1, z)]
+							- sums[index(x, y, z + 1)] - sums[index(x, y + 1, z)] - sums[index(x + 1, y, z)]
+							+ sums[index(x, y, z)];
+				}
+			}
+		}
+	}
+
+	size_t index(int x, int y, int z) const
+	{
+		return ((size_t)z * (sizeY + 1) + y) * (sizeX + 1) + x;
+	}
+
+	// Sum of lo..hi, hi exclusive
+	int count(const int* lo, const int* hi) const
+	{
+		return sums[index(hi[0], hi[1], hi[2])]
+				- sums[index(lo[0], hi[1], hi[2])] - sums[index(hi[0], lo[1], hi[2])] - sums[index(hi[0], hi[1], lo[2])]
+				+ sums[index(lo[0], lo[1], hi[2])] + sums[index(lo[0], hi[1], lo[2])] + sums[index(hi[0], lo[1], lo[2])]
+				- sums[index(lo[0], lo[1], lo[2])];
+	}
+};
+
+/*
+ * Approximate axial BSP of q3map2 for one hint size and blocksize, see
+ * qine::estimateCompileCost. Boxes are in cells, hi exclusive.
+ */
+class bspEstimator {
+public:
+	struct box {
+		int lo[3];
+		int hi[3];
+	};
+
+	struct result {
+		int hintSize;
+		int blockSize;
+		long leaves;
+		long portals;
+		double cost;
+	};
+
+	bspEstimator(const vector<box> & brushes, const volumeSum & open, int hintSize, int blockSize, int cellSize) :
+		m_Brushes(brushes), m_Open(open), m_HintSize(hintSize), m_BlockCells(blockSize / cellSize) {};
+
+	/*
+	 * Worker for the sweep, estimates the next result until all are done
+	 */
+	static void sweep(box world, const vector<box>* brushes, const volumeSum* open, int cellSize,
+			vector<result>* results, std::atomic<int>* next)
+	{
+		for (int i = (*next)++; i < results->size(); i = (*next)++)
+		{
+			result & r = (*results)[i];
+			bspEstimator estimator(*brushes, *open, r.hintSize, r.blockSize, cellSize);
+			estimator.run(world, r);
+		}
+	}
+
+	void run(const box & world, result & r)
+	{
+		vector<int> all(m_Brushes.size());
+		for (int i = 0; i < all.size(); i++)
+		{
+			all[i] = i;
+		}
+
+		build(world, all);
+		countPortals(world, r);
+		r.leaves = m_Leaves.size();
+	}
+
+private:
+	// Splits a box with open cells until no plane crosses it
+	void build(const box & b, vector<int> & brushes)
+	{
+		if (m_Open.count(b.lo, b.hi) == 0)
+		{
+			return; // solid leaf, not part of VIS
+		}
+
+		int axis;
+		int plane;
+
+		if (!gridPlane(b, m_BlockCells, false, axis, plane)
+				&& !gridPlane(b, m_HintSize, true, axis, plane)
+				&& !facePlane(b, brushes, axis, plane))
+		{
+			m_Leaves.push_back(b);
+			return;
+		}
+
+		box low = b;
+		box high = b;
+		low.hi[axis] = plane;
+		high.lo[axis] = plane;
+
+		vector<int> lowBrushes;
+		vector<int> highBrushes;
+		for (int i = 0; i < brushes.size(); i++)
+		{
+			const box & br = m_Brushes[brushes[i]];
+			if (br.lo[axis] < plane)
+			{
+				lowBrushes.push_back(brushes[i]);
+			}
+			if (br.hi[axis] > plane)
+			{
+				highBrushes.push_back(brushes[i]);
+			}
+		}
+		vector<int>().swap(brushes);
+
+		build(low, lowBrushes);
+		build(high, highBrushes);
+	}
+
+	// Multiple of size inside the box, x, y, z in turn like blocksize
+	// splits or the longest axis first like hints
+	bool gridPlane(const box & b, int size, bool longestFirst, int & axis, int & plane)
+	{
+		if (size <= 0)
+		{
+			return false;
+		}
+
+		int order[3] = { 0, 1, 2 };
+		if (longestFirst)
+		{
+			for (int i = 0; i < 3; i++)
+			{
+				for (int j = i + 1; j < 3; j++)
+				{
+					if (b.hi[order[j]] - b.lo[order[j]] > b.hi[order[i]] - b.lo[order[i]])
+					{
+						swap(order[i], order[j]);
+					}
+				}
+			}
+		}
+
+		for (int i = 0; i < 3; i++)
+		{
+			int a = order[i];
+			int first = (b.lo[a] / size + 1) * size;
+			if (first < b.hi[a])
+			{
+				int middle = ((b.lo[a] + b.hi[a]) / 2 / size) * size;
+				axis = a;
+				plane = (middle > b.lo[a]) ? middle : first;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Median brush face inside the box on the axis with the most faces
+	bool facePlane(const box & b, const vector<int> & brushes, int & axis, int & plane)
+	{
+		vector<int> faces[3];
+
+		for (int i = 0; i < brushes.size(); i++)
+		{
+			const box & br = m_Brushes[brushes[i]];
+			for (int a = 0; a < 3; a++)
+			{
+				if (br.lo[a] > b.lo[a] && br.lo[a] < b.hi[a])
+				{
+					faces[a].push_back(br.lo[a]);
+				}
+				if (br.hi[a] > b.lo[a] && br.hi[a] < b.hi[a])
+				{
+					faces[a].push_back(br.hi[a]);
+				}
+			}
+		}
+
+		axis = 0;
+		for (int a = 1; a < 3; a++)
+		{
+			if (faces[a].size() > faces[axis].size())
+			{
+				axis = a;
+			}
+		}
+
+		if (faces[axis].empty())
+		{
+			return false;
+		}
+
+		nth_element(faces[axis].begin(), faces[axis].begin() + faces[axis].size() / 2, faces[axis].end());
+		plane = faces[axis][faces[axis].size() / 2];
+		return true;
+	}
+
+	// Portals are the overlaps of leaves that touch, the cost of a leaf is
+	// its portals times the portals within its own size around it
+	void countPortals(const box & world, result & r)
+	{
+		const int cell = 4; // resolution of the portal density grid
+		int size[3];
+		for (int a = 0; a < 3; a++)
+		{
+			size[a] = (world.hi[a] + cell - 1) / cell;
+		}
+
+		vector<unsigned char> density((size_t)size[0] * size[1] * size[2], 0);
+		vector<int> leafPortals(m_Leaves.size(), 0);
+		long portals = 0;
+
+		for (int a = 0; a < 3; a++)
+		{
+			int u = (a + 1) % 3;
+			int v = (a + 2) % 3;
+
+			// Leaf faces on planes across a: coordinate, side (0 = high face), leaf
+			vector< pair< pair<int, int>, int > > faces;
+			for (int i = 0; i < m_Leaves.size(); i++)
+			{
+				faces.push_back(make_pair(make_pair(m_Leaves[i].hi[a], 0), i));
+				faces.push_back(make_pair(make_pair(m_Leaves[i].lo[a], 1), i));
+			}
+			sort (faces.begin(), faces.end());
+
+			for (int first = 0; first < faces.size(); )
+			{
+				int split = first;
+				while (split < faces.size() && faces[split].first.first == faces[first].first.first
+						&& faces[split].first.second == 0)
+				{
+					split++;
+				}
+				int last = split;
+				while (last < faces.size() && faces[last].first.first == faces[first].first.first)
+				{
+					last++;
+				}
+
+				for (int i = first; i < split; i++)
+				{
+					const box & p = m_Leaves[faces[i].second];
+					for (int j = split; j < last; j++)
+					{
+						const box & q = m_Leaves[faces[j].second];
+						int u0 = max(p.lo[u], q.lo[u]);
+						int u1 = min(p.hi[u], q.hi[u]);
+						int v0 = max(p.lo[v], q.lo[v]);
+						int v1 = min(p.hi[v], q.hi[v]);
+
+						if (u0 < u1 && v0 < v1)
+						{
+							portals++;
+							leafPortals[faces[i].second]++;
+							leafPortals[faces[j].second]++;
+
+							int c[3];
+							c[a] = min(faces[first].first.first / cell, size[a] - 1);
+							c[u] = (u0 + u1) / 2 / cell;
+							c[v] = (v0 + v1) / 2 / cell;
+							unsigned char & d = density[((size_t)c[2] * size[1] + c[1]) * size[0] + c[0]];
+							d = (d < 255) ? d + 1 : d;
+						}
+					}
+				}
+				first = last;
+			}
+		}
+
+		volumeSum near(size[0], size[1], size[2], &density[0]);
+
+		double cost = 0;
+		for (int i = 0; i < m_Leaves.size(); i++)
+		{
+			const box & l = m_Leaves[i];
+			int lo[3];
+			int hi[3];
+			for (int a = 0; a < 3; a++)
+			{
+				int extent = l.hi[a] - l.lo[a];
+				lo[a] = max(0, (l.lo[a] - extent) / cell);
+				hi[a] = min(size[a], (l.hi[a] + extent + cell - 1) / cell);
+			}
+			cost += (double)leafPortals[i] * near.count(lo, hi);
+		}
+
+		r.portals = portals;
+		r.cost = cost;
+	}
+
+	const vector<box> & m_Brushes;
+	const volumeSum & m_Open;
+	int m_HintSize;
+	int m_BlockCells;
+	vector<box> m_Leaves;
+};
+
+template <>
+struct qine::mergeTraits<optimizeByX> {
+	enum { textureMask = 0x33 };
+	static uint64_t key0(const mapBlock & b) { return packCoordinates(b.blck.y, b.blck.z); }
+	static uint64_t key1(const mapBlock & b) { return packFootprint(b.blck.length, b.blck.height, b.blck.type, b.texturing & textureMask); }
+	static int position(const mapBlock & b) { return b.blck.x; }
+	static int extent(const mapBlock & b) { return b.blck.width; }
+	static void grow(mapBlock & b, int n) { b.blck.width += n; }
+};
+
+template <>
+struct qine::mergeTraits<optimizeByY> {
+	enum { textureMask = 0x0F };
+	static uint64_t key0(const mapBlock & b) { return packCoordinates(b.blck.x, b.blck.z); }
+	static uint64_t key1(const mapBlock & b) { return packFootprint(b.blck.width, b.blck.height, b.blck.type, b.texturing & textureMask); }
+	static int position(const mapBlock & b) { return b.blck.y; }
+	static int extent(const mapBlock & b) { return b.blck.length; }
+	static void grow(mapBlock & b, int n) { b.blck.length += n; }
+};
+
+template <>
+struct qine::mergeTraits<optimizeByZ> {
+	enum { textureMask = 0x3C };
+	static uint64_t key0(const mapBlock & b) { return packCoordinates(b.blck.x, b.blck.y); }
+	static uint64_t key1(const mapBlock & b) { return packFootprint(b.blck.width, b.blck.length, b.blck.type, b.texturing & textureMask); }
+	static int position(const mapBlock & b) { return -b.blck.z; }
+	static int extent(const mapBlock & b) { return b.blck.height; }
+	static void grow(mapBlock & b, int n) { b.blck.height += n; }
+};
+
+/*
+ * Constructor.
+ */
+qine::qine(std::string datname, int width, int length, int hintSize, int worldX, int worldY, int worldZ,
+		int offsetX, int offsetY, int lod) :
+	m_Blocks(scaledSize(width, lod), scaledSize(length, lod), scaledSize(worldZ, lod)),
+	m_CheckList(scaledSize(width, lod), scaledSize(length, lod), scaledSize(worldZ, lod)),
+	m_TextureList(scaledSize(width, lod), scaledSize(length, lod), scaledSize(worldZ, lod))
+{
+	m_DatName = datname;
+
+	// With a level of detail every block of the grids stands for lod
+	// blocks of the world along every axis, the world sizes and offsets
+	// stay in blocks of the level file
+	m_Lod = lod;
+	m_LevelZ = worldZ;
+
+	m_WorldX = worldX;
+	m_WorldY = worldY;
+	m_WorldZ = scaledSize(worldZ, lod);
+
+	// The grids only hold the converted area, blocks are stored relative
+	// to its corner and moved back when written
+	m_OffsetX = offsetX;
+	m_OffsetY = offsetY;
+
+	m_Width = scaledSize(width, lod);
+	m_Length = scaledSize(length, lod);
+
+	m_HintSize = hintSize;
+
+	m_Threads = 1;
+
+	for (int i = 0; i < numStages; i++)
+	{
+		m_Budget[i] = 0;
+	}
+	m_MergeDeadline = 0;
+
+	m_MaxLights = 0;
+
+	m_BlockSize = 0;
+	m_ChopSize = 0;
+
+	m_FillHidden = false;
+	m_DetailBrushes = hintSize > 0;
+
+	m_CanopyBoxes = 0;
+	m_MergeLiquids = false;
+	m_ClipHull = false;
+
+	// One hint per hintSize^3 blocks, the last ones along every axis
+	// may be smaller. No hints at all for a hint size of 0.
+	int sizes[3] = { m_Width, m_Length, m_WorldZ };
+	for (int axis = 0; axis < 3; axis++)
+	{
+		m_NumHints[axis] = (hintSize > 0) ? (sizes[axis] + hintSize - 1) / hintSize : 0;
+	}
+
+	m_Hint3dArray.resize(m_NumHints[0]);
+	for (int i = 0; i < m_NumHints[0]; ++i)
+	{
+		m_Hint3dArray[i].resize(m_NumHints[1]);
+		for (int j = 0; j < m_NumHints[1]; ++j)
+		{
+			m_Hint3dArray[i][j].resize(m_NumHints[2]);
+		}
+	}
+}
+
+/*
+ * Reads the level data from the input file into the world grid.
+ */
+bool qine::loadWorld()
+{
+	if (!readLevel())
+	{
+		return false;
+	}
+
+	decodeLevel();
+	return true;
+}
+
+/*
+ * Reads the raw level data from the input file, the I/O half of loadWorld
+ */
+bool qine::readLevel()
+{
+	if (m_LevelFile)
+	{
+		return copyLevel();
+	}
+
+	int fd = open(m_DatName.c_str(), O_RDONLY);
+
+	if (fd < 0)
+	{
+		cout << "--- ERROR: Could not open " << m_DatName << endl;
+		return false;
+	}
+
+	int width, length, height;
+	levelArea(width, length, height);
+
+	m_LevelData.assign((size_t)width * length * height, 0);
+
+	// Only the rows of the converted area are read, a whole layer at once
+	// if it is as wide as the world. Rows past the end of the file are air.
+	int rows = (width == m_WorldX) ? length : 1;
+
+	for (int z = 0; z < height; z++)
+	{
+		for (int y = 0; y < length; y += rows)
+		{
+			// Level data starts at 0x47bc
+			off_t from = 0x47bc + ((off_t)z * m_WorldY + y + m_OffsetY) * m_WorldX + m_OffsetX;
+			char* to = &m_LevelData[((size_t)z * length + y) * width];
+
+			if (pread(fd, to, (size_t)rows * width, from) < 0)
+			{
+				cout << "--- ERROR: Could not read " << m_DatName << endl;
+				close(fd);
+				return false;
+			}
+		}
+	}
+
+	close(fd);
+
+	return true;
+}
+
+/*
+ * Copies the rows of the converted area out of the input file set by
+ * setLevelFile, like readLevel reads them
+ */
+bool qine::copyLevel()
+{
+	const std::string & file = *m_LevelFile;
+
+	int width, length, height;
+	levelArea(width, length, height);
+
+	m_LevelData.assign((size_t)width * length * height, 0);
+
+	for (int z = 0; z < height; z++)
+	{
+		for (int y = 0; y < length; y++)
+		{
+			size_t from = 0x47bc + ((size_t)z * m_WorldY + y + m_OffsetY) * m_WorldX + m_OffsetX;
+			if (from >= file.size())
+			{
+				return true;
+			}
+
+			size_t n = min((size_t)width, file.size() - from);
+			memcpy(&m_LevelData[((size_t)z * length + y) * width], file.data() + from, n);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Returns the size of the area of the level file that readLevel reads,
+ * the grids times the level of detail but not past the world
+ */
+void qine::levelArea(int & width, int & length, int & height)
+{
+	width = min(m_Width * m_Lod, m_WorldX - m_OffsetX);
+	length = min(m_Length * m_Lod, m_WorldY - m_OffsetY);
+	height = min(m_WorldZ * m_Lod, m_LevelZ);
+}
+
+/*
+ * Replaces the level data read at full size by one block per m_Lod blocks
+ * along every axis. A block is kept if at least half of the blocks it
+ * stands for are converted, and gets the most common type of the highest
+ * layer that has any, so the top of the terrain keeps its grass, sand or
+ * water instead of the dirt and stone below.
+ */
+void qine::downsampleLevel()
+{
+	int width, length, height;
+	levelArea(width, length, height);
+
+	vector<char> coarse((size_t)m_Width * m_Length * m_WorldZ, 0);
+	int volume = m_Lod * m_Lod * m_Lod;
+
+	int counts[256] = { 0 };
+	vector<int> seen;
+
+	for (int z = 0; z < m_WorldZ; z++)
+	{
+		for (int y = 0; y < m_Length; y++)
+		{
+			for (int x = 0; x < m_Width; x++)
+			{
+				int converted = 0;
+				int type = Air;
+
+				for (int dz = m_Lod - 1; dz >= 0; dz--)
+				{
+					int fz = z * m_Lod + dz;
+					if (fz >= height) continue;
+
+					int best = 0;
+					int layerType = Air;
+
+					for (int fy = y * m_Lod; fy < min((y + 1) * m_Lod, length); fy++)
+					{
+						const char* row = &m_LevelData[((size_t)fz * length + fy) * width];
+
+						for (int fx = x * m_Lod; fx < min((x + 1) * m_Lod, width); fx++)
+						{
+							int t = (unsigned char)row[fx];
+							if (!isConverted(t)) continue;
+
+							converted++;
+							if (counts[t]++ == 0) seen.push_back(t);
+							if (counts[t] > best)
+							{
+								best = counts[t];
+								layerType = t;
+							}
+						}
+					}
+
+					for (int i = 0; i < seen.size(); i++)
+					{
+						counts[seen[i]] = 0;
+					}
+					seen.clear();
+
+					if (type == Air)
+					{
+						type = layerType;
+					}
+				}
+
+				if (2 * converted >= volume)
+				{
+					coarse[((size_t)z * m_Length + y) * m_Width + x] = type;
+				}
+			}
+		}
+	}
+
+	m_LevelData.swap(coarse);
+}
+
+/*
+ * Lets readLevel and computeCacheKey use the input file held by the
+ * server instead of reading it again
+ */
+void qine::setLevelFile(blobCache::blob file)
+{
+	m_LevelFile = file;
+}
+
+/*
+ * Fills the world grid from the data read by readLevel and frees it
+ */
+void qine::decodeLevel()
+{
+	if (m_Lod > 1)
+	{
+		downsampleLevel();
+	}
+
+	const char* leveldata = &m_LevelData[0];
+
+	// The data holds the converted area only, index with shifts for the
+	// common power of two sizes
+	if (m_Width == 256 && m_Length == 256)
+	{
+		populateWorld(leveldata, levelLayout<8, 8>(m_Width, m_Length));
+	}
+	else if (m_Width == 512 && m_Length == 512)
+	{
+		populateWorld(leveldata, levelLayout<9, 9>(m_Width, m_Length));
+	}
+	else if (m_Width == 128 && m_Length == 128)
+	{
+		populateWorld(leveldata, levelLayout<7, 7>(m_Width, m_Length));
+	}
+	else if (m_Width == 64 && m_Length == 64)
+	{
+		populateWorld(leveldata, levelLayout<6, 6>(m_Width, m_Length));
+	}
+	else
+	{
+		populateWorld(leveldata, levelLayout<0, 0>(m_Width, m_Length));
+	}
+
+	vector<char>().swap(m_LevelData);
+
+	cout << m_Blocks.uniformBricks() << " of " << m_Blocks.brickCount() << " bricks are uniform ("
+			<< m_Blocks.memoryUsage() / 1024 << " KB)" << endl;
+	cout << m_Spans.size() << " spans in " << m_Width * m_Length << " columns" << endl;
+}
+
+/*
+ * Fills the world grid and the columns from the level data, one brick at
+ * a time so uniform bricks never get a cell array.
+ */
+template <class layout>
+void qine::populateWorld(const char* leveldata, const layout & level)
+{
+	vector<unsigned char> cells(BRICK_VOLUME);
+
+	for (int b = 0; b < m_Blocks.brickCount(); b++)
+	{
+		brickGrid::brick & brk = m_Blocks.getBrick(b);
+		int rowLength = max(0, min(BRICK_SIZE, m_Width - brk.x));
+
+		for (int z = 0; z < BRICK_SIZE; z++)
+		{
+			for (int y = 0; y < BRICK_SIZE; y++)
+			{
+				unsigned char* cell = &cells[brickGrid::cellIndex(0, y, z)];
+
+				if (brk.y + y >= m_Length || brk.z + z >= m_WorldZ)
+				{
+					memset(cell, Air, BRICK_SIZE);
+					continue;
+				}
+
+				const char* row = leveldata + level.index(brk.x, brk.y + y, brk.z + z);
+				memcpy(cell, row, rowLength);
+				memset(cell + rowLength, Air, BRICK_SIZE - rowLength);
+			}
+		}
+
+		brk.cells = cells;
+		brickGrid::compact(brk);
+	}
+
+	// and as runs of the same type in every column, bottom to top
+	m_Spans.clear();
+	m_ColumnStart.resize(m_Width * m_Length + 1);
+
+	for (int y = 0; y < m_Length; y++)
+	{
+		for (int x = 0; x < m_Width; x++)
+		{
+			int columnStart = m_Spans.size();
+			m_ColumnStart[x + y * m_Width] = columnStart;
+
+			const char* cell = leveldata + level.index(x, y, 0);
+			for (int z = 0; z < m_WorldZ; z++, cell += level.stepZ())
+			{
+				appendSpan(m_Spans, columnStart, z, z, (unsigned char)*cell);
+			}
+		}
+	}
+	m_ColumnStart[m_Width * m_Length] = m_Spans.size();
+}
+
+/*
+ * Destructor
+ */
+qine::~qine()
+{
+}
+
+/*
+ * Gets block type at x,y,z from supplied grid
+ */
+char qine::getBlockAtXYZ(brickGrid & grid, int x, int y, int z)
+{
+	return grid.get(x, y, z);
+}
+
+/*
+ * Sets block type at x,y,z on supplied grid
+ */
+void qine::setBlockAtXYZ(brickGrid & grid, int x, int y, int z, char ch)
+{
+	grid.set(x, y, z, ch);
+}
+
+/*
+ * Returns the same value for water and stationary water, and for lava and
+ * stationary lava, and 0 for all other types
+ */
+int qine::liquidFamily(int type)
+{
+	if (type == Water || type == StationaryWater) return Water;
+	if (type == Lava || type == StationaryLava) return Lava;
+	return 0;
+}
+
+/*
+ * Returns true if the block type is part of a tree
+ */
+bool qine::isFoliage(int type)
+{
+	return type == Wood || type == Leaves;
+}
+
+/*
+ * Returns true if the block type is converted, all other types are removed
+ * by filterBlocks
+ */
+bool qine::isConverted(int type)
+{
+	return (type == Stone ||
+			type == Grass   ||
+			type == Dirt ||
+			type == Cobblestone ||
+			type == Bedrock ||
+			type == Water ||
+			type == StationaryWater ||
+			type == Lava ||
+			type == StationaryLava ||
+			type == Sand ||
+			type == Gravel ||
+			type == GoldOre ||
+			type == IronOre ||
+			type == CoalOre ||
+			type == Wood ||
+			type == Leaves ||
+			type == Sandstone ||
+			type == Glass ||
+			type == LapisLazuliOre ||
+			type == LapisLazuliBlock ||
+			type == MossStone ||
+			type == Obsidian ||
+			type == DiamondOre ||
+			type == Farmland ||
+			type == RedstoneOre ||
+			type == GlowingRedstoneOre ||
+			type == Snow ||
+			type == Ice ||
+			type == SnowBlock ||
+			type == ClayBlock ||
+			type == SoulSand ||
+			type == GlowstoneBlock
+			);
+}
+
+/*
+ * Removes (set to Air) all blocks not listed in isConverted
+ */
+void qine::filterBlocks()
+{
+	int blocksFiltered = 0;
+
+	unsigned char filtered[256];
+	for (int t = 0; t < 256; t++)
+	{
+		filtered[t] = isConverted(t) ? t : Air;
+	}
+
+	for (int b = 0; b < m_Blocks.brickCount(); b++)
+	{
+		brickGrid::brick & brk = m_Blocks.getBrick(b);
+
+		// create bedrock in the three lowest layers because of problems with lava
+		// TODO: Confirm that this is still a problem or if this can be removed
+		bool bottom = brk.z < 3;
+
+		// A uniform brick is filtered as a whole
+		if (brk.isUniform() && !bottom)
+		{
+			if (filtered[brk.value] != brk.value)
+			{
+				blocksFiltered += BRICK_VOLUME;
+				brickGrid::fill(brk, Air);
+			}
+			continue;
+		}
+
+		if (brk.isUniform())
+		{
+			brk.cells.assign(BRICK_VOLUME, brk.value);
+		}
+
+		for (int i = 0; i < BRICK_VOLUME; i++)
+		{
+			if (bottom && brk.z + (i >> (2 * BRICK_BITS)) < 3)
+			{
+				brk.cells[i] = Stone;
+			}
+			else if (filtered[brk.cells[i]] != brk.cells[i])
+			{
+				blocksFiltered++;
+				brk.cells[i] = Air;
+			}
+		}
+
+		brickGrid::compact(brk);
+	}
+
+	// Same filter on the columns
+	vector<span> spans;
+	spans.reserve(m_Spans.size());
+
+	for (int column = 0; column < m_Width * m_Length; column++)
+	{
+		int columnStart = spans.size();
+
+		for (int s = m_ColumnStart[column]; s < m_ColumnStart[column + 1]; s++)
+		{
+			const span & sp = m_Spans[s];
+
+			if (sp.z0 < 3)
+			{
+				appendSpan(spans, columnStart, sp.z0, min((int)sp.z1, 2), Stone);
+			}
+			if (sp.z1 >= 3)
+			{
+				appendSpan(spans, columnStart, max((int)sp.z0, 3), sp.z1, filtered[sp.type]);
+			}
+		}
+
+		m_ColumnStart[column] = columnStart;
+	}
+	m_ColumnStart[m_Width * m_Length] = spans.size();
+	m_Spans.swap(spans);
+
+	cout << dec << blocksFiltered << " unwanted \"blocks\" (like flowers) filtered out (" << 100*blocksFiltered/(m_Width * m_Length * m_WorldZ) << " %)" << endl ;
+}
+
+/*
+ * Removes all blocks that we cannot see from the given x,y,z position
+ * using a flood fill algorithm. Also mark hints for deletion.
+ */
+bool qine::checkBlockList()
+{
+	arenaScope scope(m_Arena);
+	arenaAllocator<char> alloc(m_Arena);
+
+	// The visited flags and the queue in one block
+	m_Arena.reserve(m_Spans.size() * (sizeof(char) + sizeof(pair<int, int>)) + 4096);
+
+	arenaVector<char>::type visited(m_Spans.size(), 0, alloc);
+	arenaVector< pair<int, int> >::type checkList(alloc); // column, span
+	checkList.reserve(m_Spans.size());
+
+	// Choose a good start position for the flood fill
+	int startX = m_Width / 2;
+	int startY = m_Length / 2;
+	int startColumn = startX + startY * m_Width;
+	int startSpan = findSpan(startColumn, m_WorldZ - 1);
+
+	if (isDetail(m_Spans[startSpan].type))
+	{
+		setBlockAtXYZ(m_CheckList, startX, startY, m_WorldZ - 1, 1);
+		buildReached();
+		return true;
+	}
+
+	visited[startSpan] = 1;
+	checkList.push_back(make_pair(startColumn, startSpan));
+
+	m_Progress.begin("flood fill", m_Spans.size(),
+			m_Budget[stageCheck] > 0 ? currentTime() + m_Budget[stageCheck] : 0);
+
+	for (int head = 0; head < checkList.size(); head++)
+	{
+		// A partial flood fill would drop visible blocks, so stop without a result
+		if (!m_Progress.update(head))
+		{
+			return false;
+		}
+
+		int column = checkList[head].first;
+		const span & sp = m_Spans[checkList[head].second];
+
+		int x = column % m_Width;
+		int y = column / m_Width;
+
+		// The whole span is reached, see-through blocks are 2 so the
+		// pyramid can tell them from the solid blocks around them
+		for (int z = sp.z0; z <= sp.z1; z++)
+		{
+			setBlockAtXYZ(m_CheckList, x, y, z, 2);
+		}
+
+		if (sp.z1 < m_WorldZ - 1)
+		{
+			visitSpans(column, sp.z1 + 1, sp.z1 + 1, checkList, visited);
+		}
+		if (sp.z0 > 0)
+		{
+			visitSpans(column, sp.z0 - 1, sp.z0 - 1, checkList, visited);
+		}
+		if (x < m_Width - 1)
+		{
+			visitSpans(column + 1, sp.z0, sp.z1, checkList, visited);
+		}
+		if (x > 0)
+		{
+			visitSpans(column - 1, sp.z0, sp.z1, checkList, visited);
+		}
+		if (y < m_Length - 1)
+		{
+			visitSpans(column + m_Width, sp.z0, sp.z1, checkList, visited);
+		}
+		if (y > 0)
+		{
+			visitSpans(column - m_Width, sp.z0, sp.z1, checkList, visited);
+		}
+	}
+
+	computeExposure();
+	buildReached();
+	return true;
+}
+
+/*
+ * Builds the pyramid of the blocks reached by the flood fill
+ */
+void qine::buildReached()
+{
+	unsigned char classes[256] = { 0 };
+	classes[1] = occupancyPyramid::solid;
+	classes[2] = occupancyPyramid::open;
+
+	m_Reached.build(m_CheckList, m_Width, m_Length, m_WorldZ, classes);
+}
+
+/*
+ * Visits the cells z0..z1 of a column next to a reached span. Marks solid
+ * blocks as reached and queues see-through spans that have not been
+ * reached yet.
+ */
+void qine::visitSpans(int column, int z0, int z1,
+		arenaVector< pair<int, int> >::type & checkList, arenaVector<char>::type & visited)
+{
+	int x = column % m_Width;
+	int y = column / m_Width;
+
+	for (int s = findSpan(column, z0); s < m_ColumnStart[column + 1] && m_Spans[s].z0 <= z1; s++)
+	{
+		const span & sp = m_Spans[s];
+		int from = max(z0, (int)sp.z0);
+		int to = min(z1, (int)sp.z1);
+
+		for (int z = from; z <= to && isDetail(sp.type); z++)
+		{
+			setBlockAtXYZ(m_CheckList, x, y, z, 1);
+		}
+
+		if (!isDetail(sp.type) && !visited[s])
+		{
+			visited[s] = 1;
+			checkList.push_back(make_pair(column, s));
+		}
+	}
+}
+
+/*
+ * Sets the texturing of every block from its six neighbours in one sweep
+ * over the layers. A side is textured if the neighbour it faces was reached
+ * by the flood fill and is not detail, and the block is solid or a liquid
+ * next to air. Three padded layers of neighbour classes are kept so the
+ * inner loop has no branches.
+ */
+void qine::computeExposure()
+{
+	arenaScope scope(m_Arena);
+	arenaAllocator<unsigned char> alloc(m_Arena);
+
+	const unsigned char OPEN = 1; // reached and not detail
+	const unsigned char AIR = 2;
+
+	unsigned char solidMask[256];
+	unsigned char liquidMask[256];
+	for (int t = 0; t < 256; t++)
+	{
+		solidMask[t] = isSolid(t) ? 0xff : 0;
+		liquidMask[t] = isLiquid(t) ? 0xff : 0;
+	}
+
+	int stride = m_Width + 2;
+	int planeSize = stride * (m_Length + 2);
+
+	// Classes of the layers below, at and above z, zero outside the world
+	arenaVector<unsigned char>::type planes(3 * planeSize, 0, alloc);
+	arenaVector<unsigned char>::type types(m_Width, 0, alloc);
+	arenaVector<unsigned char>::type faces(m_Width, 0, alloc);
+
+	unsigned char* below = &planes[0];
+	unsigned char* layer = &planes[planeSize];
+	unsigned char* above = &planes[2 * planeSize];
+
+	loadExposureLayer(0, above);
+
+	for (int z = 0; z < m_WorldZ; z++)
+	{
+		unsigned char* oldBelow = below;
+		below = layer;
+		layer = above;
+		above = oldBelow;
+
+		if (z + 1 < m_WorldZ)
+		{
+			loadExposureLayer(z + 1, above);
+		}
+		else
+		{
+			memset(above, 0, planeSize);
+		}
+
+		for (int y = 0; y < m_Length; y++)
+		{
+			int row = (y + 1) * stride + 1;
+
+			m_Blocks.getRow(0, y, z, m_Width, &types[0]);
+
+			unsigned char any = 0;
+			for (int x = 0; x < m_Width; x++)
+			{
+				int i = row + x;
+				unsigned char solid = solidMask[types[x]];
+				unsigned char liquid = liquidMask[types[x]];
+				unsigned char n[6] = { above[i], below[i], layer[i + 1], layer[i - 1], layer[i + stride], layer[i - stride] };
+				unsigned char bits[6] = { zp, zm, xp, xm, yp, ym };
+
+				unsigned char f = 0;
+				for (int d = 0; d < 6; d++)
+				{
+					unsigned char open = -(n[d] & OPEN);
+					unsigned char air = -((n[d] & AIR) >> 1);
+					f |= bits[d] & open & (solid | (liquid & air));
+				}
+				faces[x] = f;
+				any |= f;
+			}
+
+			if (any == 0)
+			{
+				continue;
+			}
+
+			for (int x = 0; x < m_Width; x++)
+			{
+				if (faces[x] != 0)
+				{
+					setBlockAtXYZ(m_TextureList, x, y, z, faces[x]);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Fills the inner part of a padded plane with the OPEN and AIR classes
+ * of layer z used by computeExposure
+ */
+void qine::loadExposureLayer(int z, unsigned char* plane)
+{
+	int stride = m_Width + 2;
+
+	unsigned char classes[256];
+	for (int t = 0; t < 256; t++)
+	{
+		classes[t] = (isDetail(t) ? 0 : 1) | (t == Air ? 2 : 0);
+	}
+
+	vector<unsigned char> types(m_Width);
+	vector<unsigned char> reached(m_Width);
+
+	for (int y = 0; y < m_Length; y++)
+	{
+		unsigned char* row = plane + (y + 1) * stride + 1;
+
+		m_Blocks.getRow(0, y, z, m_Width, &types[0]);
+		m_CheckList.getRow(0, y, z, m_Width, &reached[0]);
+
+		for (int x = 0; x < m_Width; x++)
+		{
+			unsigned char open = -(reached[x] != 0);
+			row[x] = classes[types[x]] & (open | 2);
+		}
+	}
+}
+
+/*
+ * Returns the span of the column that contains z
+ */
+int qine::findSpan(int column, int z)
+{
+	int first = m_ColumnStart[column];
+	int last = m_ColumnStart[column + 1] - 1;
+
+	// Binary search, columns have few spans but the sky is at the end
+	while (first < last)
+	{
+		int middle = (first + last) / 2;
+		if (m_Spans[middle].z1 < z)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+	return first;
+}
+
+/*
+ * Adds z0..z1 of the given type to the top of the column starting at
+ * columnStart, growing the top span if it has the same type.
+ */
+void qine::appendSpan(vector<span> & spans, int columnStart, int z0, int z1, int type)
+{
+	if (spans.size() > columnStart && spans.back().type == type && spans.back().z1 == z0 - 1)
+	{
+		spans.back().z1 = z1;
+	}
+	else
+	{
+		spans.push_back(span(z0, z1, type));
+	}
+}
+
+/*
+ * Returns true if the block type is water or lava
+ */
+bool qine::isLiquid(int type)
+{
+	return (type == Water ||
+			type == StationaryWater ||
+			type == Lava ||
+			type == StationaryLava
+			);
+}
+
+/*
+ * Returns true if the block type is a solid
+ */
+bool qine::isSolid(int type)
+{
+	return !(type == Air ||
+			type == Water ||
+			type == StationaryWater ||
+			type == Lava ||
+			type == StationaryLava
+			);
+}
+
+/*
+ * Returns true if the block type should be a detail brush
+ */
+bool qine::isDetail(int type)
+{
+	return !(type == Air ||
+			type == Water ||
+			type == StationaryWater ||
+			type == Lava ||
+			type == StationaryLava ||
+			type == Wood || // To be able to make them detail
+			type == Leaves
+			);
+}
+
+
+/*
+ * Sets all the blocks that are not in m_Checklist to Air, or to Caulk if
+ * the hidden volume is filled so it merges into a few large brushes that
+ * seal the underside of the visible shell.
+ */
+void qine::removeUncheckedBlocks()
+{
+	int numBlocks = 0;
+	unsigned char hidden = m_FillHidden ? Caulk : Air;
+
+	for (int b = 0; b < m_Blocks.brickCount(); b++)
+	{
+		brickGrid::brick & brk = m_Blocks.getBrick(b);
+		brickGrid::brick & checked = m_CheckList.brickAt(brk.x, brk.y, brk.z);
+
+		// The bricks at the far sides reach past the area, those cells stay empty
+		int sizeX = min(BRICK_SIZE, m_Width - brk.x);
+		int sizeY = min(BRICK_SIZE, m_Length - brk.y);
+		int sizeZ = min(BRICK_SIZE, m_WorldZ - brk.z);
+		bool whole = sizeX == BRICK_SIZE && sizeY == BRICK_SIZE && sizeZ == BRICK_SIZE;
+
+		if (checked.isUniform())
+		{
+			// Nothing or everything in this brick was reached
+			if (checked.value != 0)
+			{
+				continue;
+			}
+			if (whole)
+			{
+				numBlocks += BRICK_VOLUME;
+				brickGrid::fill(brk, hidden);
+				continue;
+			}
+		}
+
+		if (brk.isUniform())
+		{
+			if (brk.value == hidden) continue;
+			brk.cells.assign(BRICK_VOLUME, brk.value);
+		}
+
+		for (int z = 0; z < sizeZ; z++)
+		{
+			for (int y = 0; y < sizeY; y++)
+			{
+				for (int x = 0; x < sizeX; x++)
+				{
+					int i = brickGrid::cellIndex(x, y, z);
+					if ((checked.isUniform() ? checked.value : checked.cells[i]) == 0)
+					{
+						brk.cells[i] = hidden;
+						numBlocks++;
+					}
+				}
+			}
+		}
+
+		brickGrid::compact(brk);
+	}
+
+	if (m_FillHidden)
+	{
+		cout << numBlocks << " hidden blocks filled with caulk" << endl;
+	}
+}
+
+/*
+ * Covers every body of water and lava with few boxes and replaces its
+ * blocks by them. A box grows along x, then y, then down as long as the
+ * slice it grows by is the same liquid and no side of the box would
+ * both touch the open air and the rest of the body, so only the surface
+ * is textured. The other sides get the caulk of the liquid.
+ */
+void qine::mergeLiquids()
+{
+	if (!m_MergeLiquids)
+	{
+		return;
+	}
+
+	brickGrid taken(m_Width, m_Length, m_WorldZ);
+	int size[3] = { m_Width, m_Length, m_WorldZ };
+
+	int numBlocks = 0;
+	int first = m_Boxes.size();
+
+	// Bodies are widest at the top, so start there and grow down
+	for (int z = m_WorldZ - 1; z >= 0; z--)
+	{
+		for (int y = 0; y < m_Length; y++)
+		{
+			for (int x = 0; x < m_Width; x++)
+			{
+				int type = m_Blocks.get(x, y, z);
+
+				if (!isLiquid(type) || taken.get(x, y, z))
+				{
+					continue;
+				}
+
+				int lo[3] = { x, y, z };
+				int hi[3] = { x + 1, y + 1, z + 1 };
+				int textured = 0;
+				int hidden = 0;
+
+				addLiquidSlice(lo, hi, lo, hi, type, taken, textured, hidden);
+
+				// Along +x, +y and -z
+				for (int axis = 0; axis < 3; axis++)
+				{
+					int end = (axis == 0) ? xp : (axis == 1) ? yp : zm;
+
+					while (axis < 2 ? hi[axis] < size[axis] : lo[axis] > 0)
+					{
+						int sliceLo[3] = { lo[0], lo[1], lo[2] };
+						int sliceHi[3] = { hi[0], hi[1], hi[2] };
+						int grownLo[3] = { lo[0], lo[1], lo[2] };
+						int grownHi[3] = { hi[0], hi[1], hi[2] };
+
+						if (axis < 2)
+						{
+							sliceLo[axis] = hi[axis];
+							sliceHi[axis] = ++grownHi[axis];
+						}
+						else
+						{
+							sliceHi[axis] = lo[axis];
+							sliceLo[axis] = --grownLo[axis];
+						}
+
+						// The old end of the box is inside it now
+						int t = textured & ~end;
+						int h = hidden & ~end;
+
+						if (!addLiquidSlice(sliceLo, sliceHi, grownLo, grownHi, type, taken, t, h) || (t & h) != 0)
+						{
+							break;
+						}
+
+						lo[axis] = grownLo[axis];
+						hi[axis] = grownHi[axis];
+						textured = t;
+						hidden = h;
+					}
+				}
+
+				for (int bz = lo[2]; bz < hi[2]; bz++)
+				{
+					for (int by = lo[1]; by < hi[1]; by++)
+					{
+						for (int bx = lo[0]; bx < hi[0]; bx++)
+						{
+							taken.set(bx, by, bz, 1);
+						}
+					}
+				}
+
+				block blk(lo[0], lo[1], hi[2] - 1, type);
+				blk.width = hi[0] - lo[0];
+				blk.length = hi[1] - lo[1];
+				blk.height = hi[2] - lo[2];
+				m_Boxes.push_back(mapBlock(blk, textured));
+				numBlocks += blk.width * blk.length * blk.height;
+			}
+		}
+	}
+
+	for (int i = first; i < m_Boxes.size(); i++)
+	{
+		const block & blk = m_Boxes[i].blck;
+
+		for (int bz = blk.z - blk.height + 1; bz <= blk.z; bz++)
+		{
+			for (int by = blk.y; by < blk.y + blk.length; by++)
+			{
+				for (int bx = blk.x; bx < blk.x + blk.width; bx++)
+				{
+					m_Blocks.set(bx, by, bz, Air);
+				}
+			}
+		}
+	}
+
+	for (int b = 0; b < m_Blocks.brickCount(); b++)
+	{
+		brickGrid::compact(m_Blocks.getBrick(b));
+	}
+
+	cout << numBlocks << " liquid blocks covered by " << m_Boxes.size() - first << " boxes" << endl;
+}
+
+/*
+ * Covers every solid block the player can touch with few large clip boxes.
+ * The player can be in every reached block of air, water or lava, a box
+ * may take any other block, so it grows along x, then y, then down through
+ * the ground and the hidden volume until it would reach into open space.
+ * Clip boxes have no textured side and may overlap. The terrain is still
+ * written solid, so the boxes only take over collision with nonsolid
+ * shaders for the terrain textures.
+ */
+void qine::createClipHull()
+{
+	if (!m_ClipHull)
+	{
+		return;
+	}
+
+	const int sides[][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+
+	brickGrid covered(m_Width, m_Length, m_WorldZ);
+	int size[3] = { m_Width, m_Length, m_WorldZ };
+
+	int numBlocks = 0;
+	int first = m_Boxes.size();
+
+	// Walkable surfaces face up, so start at the top and grow down
+	for (int z = m_WorldZ - 1; z >= 0; z--)
+	{
+		for (int y = 0; y < m_Length; y++)
+		{
+			for (int x = 0; x < m_Width; x++)
+			{
+				int type = m_Blocks.get(x, y, z);
+
+				if (type == Air || liquidFamily(type) != 0 || !m_CheckList.get(x, y, z))
+				{
+					continue;
+				}
+
+				bool touched = false;
+				for (int s = 0; s < 6 && !touched; s++)
+				{
+					int nx = x + sides[s][0];
+					int ny = y + sides[s][1];
+					int nz = z + sides[s][2];
+
+					touched = nx >= 0 && nx < m_Width && ny >= 0 && ny < m_Length && nz >= 0 && nz < m_WorldZ
+							&& isPlayerOpen(nx, ny, nz);
+				}
+
+				if (!touched)
+				{
+					continue;
+				}
+
+				numBlocks++;
+				if (covered.get(x, y, z))
+				{
+					continue;
+				}
+
+				int lo[3] = { x, y, z };
+				int hi[3] = { x + 1, y + 1, z + 1 };
+
+				// Along +x, +y and -z
+				for (int axis = 0; axis < 3; axis++)
+				{
+					while (axis < 2 ? hi[axis] < size[axis] : lo[axis] > 0)
+					{
+						int sliceLo[3] = { lo[0], lo[1], lo[2] };
+						int sliceHi[3] = { hi[0], hi[1], hi[2] };
+
+						if (axis < 2)
+						{
+							sliceLo[axis] = hi[axis];
+							sliceHi[axis] = hi[axis] + 1;
+						}
+						else
+						{
+							sliceHi[axis] = lo[axis];
+							sliceLo[axis] = lo[axis] - 1;
+						}
+
+						if (!isClipSlice(sliceLo, sliceHi))
+						{
+							break;
+						}
+
+						lo[axis] = min(lo[axis], sliceLo[axis]);
+						hi[axis] = max(hi[axis], sliceHi[axis]);
+					}
+				}
+
+				for (int bz = lo[2]; bz < hi[2]; bz++)
+				{
+					for (int by = lo[1]; by < hi[1]; by++)
+					{
+						for (int bx = lo[0]; bx < hi[0]; bx++)
+						{
+							covered.set(bx, by, bz, 1);
+						}
+					}
+				}
+
+				block blk(lo[0], lo[1], hi[2] - 1, Clip);
+				blk.width = hi[0] - lo[0];
+				blk.length = hi[1] - lo[1];
+				blk.height = hi[2] - lo[2];
+				m_Boxes.push_back(mapBlock(blk, 0));
+			}
+		}
+	}
+
+	cout << numBlocks << " blocks the player can touch covered by " << m_Boxes.size() - first << " clip boxes" << endl;
+}
+
+/*
+ * Returns true if the player can be in block x, y, z
+ */
+bool qine::isPlayerOpen(int x, int y, int z)
+{
+	int type = m_Blocks.get(x, y, z);
+	return m_CheckList.get(x, y, z) && (type == Air || liquidFamily(type) != 0);
+}
+
+/*
+ * Returns true if no block of slice [lo, hi) is open to the player
+ */
+bool qine::isClipSlice(const int* lo, const int* hi)
+{
+	for (int z = lo[2]; z < hi[2]; z++)
+	{
+		for (int y = lo[1]; y < hi[1]; y++)
+		{
+			for (int x = lo[0]; x < hi[0]; x++)
+			{
+				if (isPlayerOpen(x, y, z))
+				{
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Adds the cells of slice [sliceLo, sliceHi) to the sides of box [lo, hi)
+ * they lie on: textured gets the sides facing open air, hidden the sides
+ * facing water, lava or other see-through blocks. Returns false if a
+ * cell is taken or not the same liquid as type.
+ */
+bool qine::addLiquidSlice(const int* sliceLo, const int* sliceHi, const int* lo, const int* hi, int type,
+		brickGrid & taken, int & textured, int & hidden)
+{
+	const int sides[][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+	const int bits[] = { xp, xm, yp, ym, zp, zm };
+
+	for (int z = sliceLo[2]; z < sliceHi[2]; z++)
+	{
+		for (int y = sliceLo[1]; y < sliceHi[1]; y++)
+		{
+			for (int x = sliceLo[0]; x < sliceHi[0]; x++)
+			{
+				if (liquidFamily(m_Blocks.get(x, y, z)) != liquidFamily(type) || taken.get(x, y, z))
+				{
+					return false;
+				}
+
+				int onSides = (x == hi[0] - 1 ? xp : 0) | (x == lo[0] ? xm : 0)
+						| (y == hi[1] - 1 ? yp : 0) | (y == lo[1] ? ym : 0)
+						| (z == hi[2] - 1 ? zp : 0) | (z == lo[2] ? zm : 0);
+
+				int faces = m_TextureList.get(x, y, z);
+				int seeThrough = 0;
+
+				for (int s = 0; s < 6; s++)
+				{
+					int nx = x + sides[s][0];
+					int ny = y + sides[s][1];
+					int nz = z + sides[s][2];
+
+					if ((onSides & bits[s]) && nx >= 0 && nx < m_Width && ny >= 0 && ny < m_Length
+							&& nz >= 0 && nz < m_WorldZ && !isDetail(m_Blocks.get(nx, ny, nz)))
+					{
+						seeThrough |= bits[s];
+					}
+				}
+
+				textured |= faces & onSides;
+				hidden |= seeThrough & ~faces;
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Orders cells (x + (y + z * length) * width) by one of their coordinates
+ */
+struct canopyOrder {
+	int axis;
+	int width;
+	int length;
+
+	canopyOrder(int axis, int width, int length) : axis(axis), width(width), length(length) {};
+
+	int coord(int cell) const
+	{
+		if (axis == 0) return cell % width;
+		if (axis == 1) return (cell / width) % length;
+		return cell / (width * length);
+	}
+
+	bool operator()(int first, int second) const { return coord(first) < coord(second); }
+};
+
+/*
+ * Replaces the leaves of every tree by a few boxes. A tree is a connected
+ * group of Wood and Leaves blocks, its trunks stay and merge into columns
+ * like any other block. The leaves get m_CanopyBoxes boxes per trunk, so
+ * a forest with touching crowns is not squashed into a handful of boxes.
+ */
+void qine::simplifyFoliage()
+{
+	if (m_CanopyBoxes == 0)
+	{
+		return;
+	}
+
+	const int sides[][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+
+	brickGrid seen(m_Width, m_Length, m_WorldZ);
+	vector<int> queue;
+	vector<int> leaves;
+
+	int numTrees = 0;
+	int numLeaves = 0;
+	int numBoxes = m_Boxes.size();
+
+	for (int b = 0; b < m_Blocks.brickCount(); b++)
+	{
+		brickGrid::brick & brk = m_Blocks.getBrick(b);
+
+		if (brk.isUniform() && !isFoliage(brk.value))
+		{
+			continue;
+		}
+
+		for (int i = 0; i < BRICK_VOLUME; i++)
+		{
+			int x = brk.x + (i & BRICK_MASK);
+			int y = brk.y + ((i >> BRICK_BITS) & BRICK_MASK);
+			int z = brk.z + (i >> (2 * BRICK_BITS));
+
+			if (x >= m_Width || y >= m_Length || z >= m_WorldZ
+					|| !isFoliage(m_Blocks.get(x, y, z)) || seen.get(x, y, z))
+			{
+				continue;
+			}
+
+			// Collect the tree, counting the lowest block of every trunk
+			queue.clear();
+			leaves.clear();
+			int trunks = 0;
+
+			queue.push_back(x + (y + z * m_Length) * m_Width);
+			seen.set(x, y, z, 1);
+
+			for (int q = 0; q < queue.size(); q++)
+			{
+				int cx = queue[q] % m_Width;
+				int cy = (queue[q] / m_Width) % m_Length;
+				int cz = queue[q] / (m_Width * m_Length);
+
+				if (m_Blocks.get(cx, cy, cz) == Leaves)
+				{
+					leaves.push_back(queue[q]);
+				}
+				else if (cz == 0 || m_Blocks.get(cx, cy, cz - 1) != Wood)
+				{
+					trunks++;
+				}
+
+				for (int s = 0; s < 6; s++)
+				{
+					int nx = cx + sides[s][0];
+					int ny = cy + sides[s][1];
+					int nz = cz + sides[s][2];
+
+					if (nx >= 0 && nx < m_Width && ny >= 0 && ny < m_Length && nz >= 0 && nz < m_WorldZ
+							&& isFoliage(m_Blocks.get(nx, ny, nz)) && !seen.get(nx, ny, nz))
+					{
+						seen.set(nx, ny, nz, 1);
+						queue.push_back(nx + (ny + nz * m_Length) * m_Width);
+					}
+				}
+			}
+
+			if (leaves.empty())
+			{
+				continue;
+			}
+
+			numTrees++;
+			numLeaves += leaves.size();
+
+			for (int l = 0; l < leaves.size(); l++)
+			{
+				m_Blocks.set(leaves[l] % m_Width, (leaves[l] / m_Width) % m_Length,
+						leaves[l] / (m_Width * m_Length), Air);
+			}
+
+			splitCanopy(leaves, 0, leaves.size(), m_CanopyBoxes * max(1, trunks));
+		}
+	}
+
+	for (int b = 0; b < m_Blocks.brickCount(); b++)
+	{
+		brickGrid::compact(m_Blocks.getBrick(b));
+	}
+
+	cout << numTrees << " trees, " << numLeaves << " leaves replaced by "
+			<< m_Boxes.size() - numBoxes << " canopy boxes" << endl;
+}
+
+/*
+ * Splits the leaves in cells[first, last) at the middle of the longest
+ * side of their bounds until there are boxes parts, and adds a box around
+ * every part to m_Boxes.
+ */
+void qine::splitCanopy(vector<int> & cells, int first, int last, int boxes)
+{
+	int lo[3] = { m_Width, m_Length, m_WorldZ };
+	int hi[3] = { -1, -1, -1 };
+
+	for (int i = first; i < last; i++)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			int c = canopyOrder(a, m_Width, m_Length).coord(cells[i]);
+			lo[a] = min(lo[a], c);
+			hi[a] = max(hi[a], c);
+		}
+	}
+
+	if (boxes <= 1 || last - first <= 1)
+	{
+		block blk(lo[0], lo[1], hi[2], Leaves);
+		blk.width = hi[0] - lo[0] + 1;
+		blk.length = hi[1] - lo[1] + 1;
+		blk.height = hi[2] - lo[2] + 1;
+		m_Boxes.push_back(mapBlock(blk, zp | zm | xp | xm | yp | ym));
+		return;
+	}
+
+	int axis = 0;
+	for (int a = 1; a < 3; a++)
+	{
+		if (hi[a] - lo[a] > hi[axis] - lo[axis])
+		{
+			axis = a;
+		}
+	}
+
+	int mid = first + (last - first) / 2;
+	nth_element(cells.begin() + first, cells.begin() + mid, cells.begin() + last,
+			canopyOrder(axis, m_Width, m_Length));
+
+	splitCanopy(cells, first, mid, boxes / 2);
+	splitCanopy(cells, mid, last, boxes - boxes / 2);
+}
+
+/*
+ * Returns the volume (in blocks) of the world
+ */
+int qine::worldSize()
+{
+	return m_WorldX*m_WorldY*m_WorldZ;
+}
+
+/*
+ * Creates a list of blocks
+ */
+int qine::createBlockList()
+{
+	// Count the blocks of every layer in parallel, place every layer at the
+	// sum of the counts below it and fill the layers in parallel again.
+	// Layers end up in the same z, y, x order as a single pass.
+	vector<int> layerOffset(m_WorldZ + 1, 0);
+	vector<int> layerVoxels(m_WorldZ, 0);
+
+	runLayers(false, &layerOffset[0], &layerVoxels[0]);
+
+	int numblocks = 0;
+	int numVoxels = 0;
+	for (int z = 0; z < m_WorldZ; z++)
+	{
+		int count = layerOffset[z];
+		layerOffset[z] = numblocks;
+		numblocks += count;
+		numVoxels += layerVoxels[z];
+	}
+	layerOffset[m_WorldZ] = numblocks;
+
+	cout << "There are " << numVoxels << " blocks in the list" <<  endl;
+
+	// The boxes of simplifyFoliage and mergeLiquids go after the layers
+	m_BlockCollection.resize(numblocks + m_Boxes.size());
+	numblocks += m_Boxes.size();
+
+	// Room for the scratch arrays of a merge pass over all blocks
+	m_Arena.reserve(numblocks * (2 * sizeof(mergeCandidate) + sizeof(mapBlock)
+			+ 2 * sizeof(uint64_t) + 2 * sizeof(int) + 1) + 4096);
+
+	runLayers(true, &layerOffset[0], &layerVoxels[0]);
+	copy(m_Boxes.begin(), m_Boxes.end(), m_BlockCollection.end() - m_Boxes.size());
+
+	// The merge stage starts here, the passes share its budget
+	m_MergeDeadline = m_Budget[stageMerge] > 0 ? currentTime() + m_Budget[stageMerge] : 0;
+
+	return numVoxels - numblocks;
+}
+
+/*
+ * Runs compactLayer on all layers using m_Threads threads, the threads
+ * take the next free layer until all are done.
+ */
+void qine::runLayers(bool write, int* counts, int* voxels)
+{
+	int numThreads = max(1, min(m_Threads, m_WorldZ));
+	std::atomic<int> nextLayer(0);
+
+	vector<std::thread> workers;
+	for (int t = 1; t < numThreads; t++)
+	{
+		workers.push_back(std::thread(&qine::compactLayers, this, write, counts, voxels, &nextLayer));
+	}
+
+	compactLayers(write, counts, voxels, &nextLayer);
+
+	for (int t = 0; t < workers.size(); t++)
+	{
+		workers[t].join();
+	}
+}
+
+/*
+ * Worker of runLayers. Counts the blocks (and non-air voxels) of a layer
+ * into counts, or writes them at the offset in counts if write is set.
+ */
+void qine::compactLayers(bool write, int* counts, int* voxels, std::atomic<int>* nextLayer)
+{
+	for (int z = (*nextLayer)++; z < m_WorldZ; z = (*nextLayer)++)
+	{
+		int count = 0;
+		int layerVoxels = 0;
+
+		for (int y = 0; y < m_Length; y++)
+		{
+			if (write)
+			{
+				// Not indexed, the offset is the end of the list if nothing is left
+				count += compactRow<true>(0, m_Width, y, z, m_BlockCollection.data() + counts[z] + count, layerVoxels);
+			}
+			else
+			{
+				count += compactRow<false>(0, m_Width, y, z, 0, layerVoxels);
+			}
+		}
+
+		if (!write)
+		{
+			counts[z] = count;
+			voxels[z] = layerVoxels;
+		}
+	}
+}
+
+/*
+ * Returns the number of blocks in row y,z from x0 to x1 (x0 is the first
+ * block of a brick) and adds its non-air voxels to voxels, writes the
+ * blocks to out if WRITE is set. A brick of one type with the same
+ * texturing everywhere is one block, added when its first row is reached.
+ */
+template <bool WRITE>
+int qine::compactRow(int x0, int x1, int y, int z, mapBlock* out, int & voxels)
+{
+	int count = 0;
+
+	for (int x = x0; x < x1; x = (x | BRICK_MASK) + 1)
+	{
+		const brickGrid::brick & brk = m_Blocks.brickAt(x, y, z);
+		const brickGrid::brick & texBrk = m_TextureList.brickAt(x, y, z);
+		int n = min((x | BRICK_MASK) + 1, x1) - x;
+
+		if (brk.isUniform())
+		{
+			if (brk.value == Air)
+			{
+				continue;
+			}
+
+			voxels += n;
+
+			if (texBrk.isUniform())
+			{
+				if ((y & BRICK_MASK) == 0 && (z & BRICK_MASK) == 0)
+				{
+					if (WRITE)
+					{
+						// Clipped to the area at the far sides
+						int height = min(BRICK_SIZE, m_WorldZ - z);
+						block blk(x, y, z + height - 1, brk.value);
+						blk.width = n;
+						blk.length = min(BRICK_SIZE, m_Length - y);
+						blk.height = height;
+						out[count] = mapBlock(blk, texBrk.value);
+					}
+					count++;
+				}
+				continue;
+			}
+
+			if (WRITE)
+			{
+				for (int i = 0; i < n; i++)
+				{
+					out[count + i] = mapBlock(block(x + i, y, z, brk.value), texBrk.cells[brickGrid::cellIndex(x + i, y, z)]);
+				}
+			}
+			count += n;
+			continue;
+		}
+
+		const unsigned char* row = &brk.cells[brickGrid::cellIndex(x, y, z)];
+
+		if (!WRITE)
+		{
+			int nonAir = countNonZero(row, n);
+			voxels += nonAir;
+			count += nonAir;
+			continue;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			if (row[i] != Air)
+			{
+				int tex = texBrk.isUniform() ? texBrk.value : texBrk.cells[brickGrid::cellIndex(x + i, y, z)];
+				out[count++] = mapBlock(block(x + i, y, z, row[i]), tex);
+			}
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Returns the number of non-zero bytes, eight at a time: a byte becomes
+ * 0x80 if it is zero so the zero bytes of a word can be counted at once.
+ */
+int qine::countNonZero(const unsigned char* bytes, int n)
+{
+	const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+	int nonZero = n;
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		uint64_t v;
+		memcpy(&v, bytes + i, 8);
+		uint64_t zeroBytes = ~(((v & low7) + low7) | v | low7);
+		nonZero -= __builtin_popcountll(zeroBytes);
+	}
+
+	for (; i < n; i++)
+	{
+		nonZero -= (bytes[i] == 0);
+	}
+
+	return nonZero;
+}
+
+void qine::createHints()
+{
+	cout << "Creating hints" << endl;
+
+	// Loop z-axis
+	for (int z = 0; z < m_NumHints[2]; z++)
+	{
+		// Loop y-axis
+		for (int y = 0; y < m_NumHints[1]; y++)
+		{
+			// Loop x-axis
+			for (int x = 0; x < m_NumHints[0]; x++)
+			{
+				// z is the top block of the hint, like the z of a block
+				m_Hint3dArray[x][y][z].x = x * m_HintSize;
+				m_Hint3dArray[x][y][z].y = y * m_HintSize;
+				m_Hint3dArray[x][y][z].z = min((z + 1) * m_HintSize, m_WorldZ) - 1;
+
+				m_Hint3dArray[x][y][z].width = min(m_HintSize, m_Width - x * m_HintSize);
+				m_Hint3dArray[x][y][z].length = min(m_HintSize, m_Length - y * m_HintSize);
+				m_Hint3dArray[x][y][z].height = min(m_HintSize, m_WorldZ - z * m_HintSize);
+				m_Hint3dArray[x][y][z].markedForDeletion = false;
+				m_Hint3dArray[x][y][z].markedForDeletion2 = false;
+			}
+		}
+	}
+
+	cout << "Creating hints done" << endl;
+}
+
+/*
+ * Marks the hints that hold some block reached by the flood fill, which
+ * the pyramid answers without visiting every block, and then the hints
+ * whose neighbours along all axes are unmarked or outside the world.
+ */
+void qine::removeUselessHints()
+{
+	cout << "Removing useless hints" << endl;
+
+	for (int z = 0; z < m_NumHints[2]; z++)
+	{
+		for (int y = 0; y < m_NumHints[1]; y++)
+		{
+			for (int x = 0; x < m_NumHints[0]; x++)
+			{
+				hintBrush & hint = m_Hint3dArray[x][y][z];
+				int lo[3] = { hint.x, hint.y, hint.z - hint.height + 1 };
+				int hi[3] = { hint.x + hint.width, hint.y + hint.length, hint.z + 1 };
+
+				hint.markedForDeletion = m_Reached.any(occupancyPyramid::open, lo, hi);
+			}
+		}
+	}
+
+	const int sides[][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+
+	for (int z = 0; z < m_NumHints[2]; z++)
+	{
+		for (int y = 0; y < m_NumHints[1]; y++)
+		{
+			for (int x = 0; x < m_NumHints[0]; x++)
+			{
+				bool isolated = true;
+
+				for (int s = 0; s < 6 && isolated; s++)
+				{
+					int nx = x + sides[s][0];
+					int ny = y + sides[s][1];
+					int nz = z + sides[s][2];
+
+					isolated = nx < 0 || nx >= m_NumHints[0] || ny < 0 || ny >= m_NumHints[1]
+							|| nz < 0 || nz >= m_NumHints[2] || !m_Hint3dArray[nx][ny][nz].markedForDeletion;
+				}
+
+				if (isolated)
+				{
+					m_Hint3dArray[x][y][z].markedForDeletion2 = true;
+				}
+			}
+		}
+	}
+}
+
+void qine::MergeHints()
+{
+	// Merging hints does not need to worry about texturing
+
+	hintBrush currentHint;
+
+	// merge x-axis
+	for (int z = 0; z < m_NumHints[2]; z++)
+	{
+		for (int y = 0; y < m_NumHints[1]; y++)
+		{
+			for (int x = 0; x < m_NumHints[0]; x++)
+			{
+				if (x == 0)
+				{
+					currentHint = m_Hint3dArray[x][y][z];
+				}
+				else
+				{
+					if (!m_Hint3dArray[x][y][z].markedForDeletion &&
+							!m_Hint3dArray[x][y][z].markedForDeletion2)
+					{
+						currentHint.width += m_HintSize;
+						m_Hint3dArray[x][y][z].markedForDeletion = true;
+					}
+					else
+					{
+						currentHint = m_Hint3dArray[x][y][z];
+					}
+				}
+			}
+		}
+	}
+
+}
+
+int qine::Optimize(int direction)
+{
+	switch(direction)
+	{
+	case optimizeByX:
+		return mergeAxis<optimizeByX>();
+	case optimizeByY:
+		return mergeAxis<optimizeByY>();
+	case optimizeByZ:
+		return mergeAxis<optimizeByZ>();
+	}
+	return 0;
+}
+
+/*
+ * Merges all blocks that touch along AXIS and have the same footprint
+ * across it, type and texturing on the sides that stay visible.
+ *
+ * Every block gets a candidate record whose key holds everything that has
+ * to be equal, the records are sorted by key and position along the axis
+ * so that every run of mergeable blocks ends up next to each other, and
+ * the runs are merged in one pass.
+ */
+template <int AXIS>
+int qine::mergeAxis()
+{
+	typedef mergeTraits<AXIS> traits;
+
+	int count = m_BlockCollection.size();
+	int merged = 0;
+
+	// All scratch memory of the pass comes from the arena
+	arenaScope scope(m_Arena);
+	arenaAllocator<char> alloc(m_Arena);
+
+	// Nothing changes before the end, so stopping keeps the last result
+	const char* names[] = { "merge x", "merge y", "merge z" };
+	m_Progress.begin(names[AXIS], 2 * (long)count, m_MergeDeadline);
+
+	if (!m_Progress.update(0))
+	{
+		return 0;
+	}
+
+	// With a level of detail the blocks stand for whole cubes whose faces
+	// show up unevenly, so merged blocks just texture every side any of
+	// them has textured instead of keeping the blocks apart
+	uint64_t key1Mask = (m_Lod > 1) ? ~(uint64_t)0x3F : ~(uint64_t)0;
+
+	arenaVector<mergeCandidate>::type candidates(count, mergeCandidate(), alloc);
+	for (int i = 0; i < count; i++)
+	{
+		if (!m_Progress.update(i))
+		{
+			return 0;
+		}
+
+		const mapBlock & mb = m_BlockCollection[i];
+		candidates[i].key0 = traits::key0(mb);
+		candidates[i].key1 = traits::key1(mb) & key1Mask;
+		candidates[i].position = traits::position(mb);
+		candidates[i].index = i;
+	}
+
+	sort (candidates.begin(), candidates.end());
+
+	// Sorted candidates as structure of arrays for the adjacency test
+	arenaVector<uint64_t>::type key0(count, 0, alloc);
+	arenaVector<uint64_t>::type key1(count, 0, alloc);
+	arenaVector<int>::type position(count, 0, alloc);
+	arenaVector<int>::type extent(count, 0, alloc);
+	arenaVector<unsigned char>::type joinsPrevious(count, 0, alloc);
+
+	for (int i = 0; i < count; i++)
+	{
+		key0[i] = candidates[i].key0;
+		key1[i] = candidates[i].key1;
+		position[i] = candidates[i].position;
+		extent[i] = traits::extent(m_BlockCollection[candidates[i].index]);
+	}
+
+	// A block joins the one before it if it has the same key and starts
+	// where the previous one ends. Branch free so it vectorises.
+	for (int i = 1; i < count; i++)
+	{
+		joinsPrevious[i] = (key0[i] == key0[i - 1])
+				& (key1[i] == key1[i - 1])
+				& (position[i] == position[i - 1] + extent[i - 1]);
+	}
+
+	arenaVector<mapBlock>::type tempMapBlockCollection(alloc);
+	tempMapBlockCollection.reserve(count);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!m_Progress.update(count + i))
+		{
+			return 0;
+		}
+
+		const mapBlock & mb = m_BlockCollection[candidates[i].index];
+
+		if (joinsPrevious[i])
+		{
+			mapBlock & currentMapBlock = tempMapBlockCollection.back();
+			traits::grow(currentMapBlock, extent[i]);
+			currentMapBlock.texturing |= mb.texturing;
+			merged++;
+		}
+		else
+		{
+			tempMapBlockCollection.push_back(mb);
+		}
+	}
+
+	// Keep the brushes ordered along the axis like the blocks were, ties
+	// in the order they were merged in
+	arenaVector<mergeCandidate>::type order(tempMapBlockCollection.size(), mergeCandidate(), alloc);
+	for (int i = 0; i < order.size(); i++)
+	{
+		order[i].key0 = 0;
+		order[i].key1 = 0;
+		order[i].position = traits::position(tempMapBlockCollection[i]);
+		order[i].index = i;
+	}
+
+	sort (order.begin(), order.end(), mergeCandidate::byPosition);
+
+	// The list only shrinks so this never reallocates
+	m_BlockCollection.resize(order.size());
+	for (int i = 0; i < order.size(); i++)
+	{
+		m_BlockCollection[i] = tempMapBlockCollection[order[i].index];
+	}
+
+	return merged;
+}
+
+/*
+ * Creates a map file from the created collection of blocks.
+ */
+void qine::createMapFile(std::string mapname)
+{
+	if (m_BlockCollection.size() == 0)
+	{
+		cout << "--- ERROR: There are no blocks in the collection" << endl;
+		return;
+	}
+
+	cout << "Writing map file..." << endl;
+
+	beginMapFile(mapname);
+
+	for (int i = 0; i <  m_BlockCollection.size(); i++)
+	{
+		createBrush( m_BlockCollection[i].blck.x,
+				 m_BlockCollection[i].blck.y,
+				 m_BlockCollection[i].blck.z,
+				 m_BlockCollection[i].blck.width,
+				 m_BlockCollection[i].blck.length,
+				 m_BlockCollection[i].blck.height,
+				 m_BlockCollection[i].blck.type,
+				 m_BlockCollection[i].texturing);
+	}
+
+	cout << "brushes done" << endl;
+
+	endMapFile();
+}
+
+/*
+ * Opens the map file and starts worldspawn with its keys
+ */
+void qine::beginMapFile(std::string mapname)
+{
+	m_OutFile.open(mapname.c_str());
+	m_OutFile << "{" << endl << "\"classname\" \"worldspawn\"" << endl;
+	writeWorldspawnKeys();
+
+	for (int i = 0; i < m_SourceKeys.size(); i++)
+	{
+		const std::string & key = m_SourceKeys[i].first;
+		if ((key == "_blocksize" && m_BlockSize > 0) || (key == "chopsize" && m_ChopSize > 0))
+		{
+			continue;
+		}
+		m_OutFile << "\"" << key << "\" \"" << m_SourceKeys[i].second << "\"" << endl;
+	}
+}
+
+/*
+ * Writes the hints and the brushes kept from a source map, ends worldspawn,
+ * writes the other entities and closes the map file
+ */
+void qine::endMapFile()
+{
+	for (int z = 0; z < m_NumHints[2]; z++)
+	{
+		for (int y = 0; y < m_NumHints[1]; y++)
+		{
+			for (int x = 0; x < m_NumHints[0]; x++)
+			{
+				if (isHintVisible(x, y, z))
+				{
+					writeHintBrush(x, y, z);
+				}
+			}
+		}
+	}
+
+	m_OutFile << m_SourceBrushes;
+
+	// TODO: Add all entities such as flowers.
+	m_OutFile << "}" << endl;
+
+	for (int i = 0; i < m_Lights.size(); i++)
+	{
+		writeLight(m_Lights[i]);
+	}
+
+	m_OutFile << m_SourceEntities;
+
+	m_OutFile.close();
+}
+
+/*
+ * Writes the map with a chunked merge: the world is cut in chunks of
+ * chunkSize x chunkSize columns (rounded up to whole bricks), and the
+ * blocks of one chunk are listed, merged along x, y and z and written as
+ * brushes before the next chunk is listed. The block list and the merge
+ * scratch are bounded by the largest chunk, the block, check and texture
+ * grids of the whole area stay loaded. Blocks are never merged across
+ * chunk borders, so there are more brushes than in a full merge. Hints
+ * and content flags are the same.
+ */
+bool qine::createChunkedMapFile(std::string mapname, int chunkSize)
+{
+	chunkSize = max(BRICK_SIZE, (chunkSize + BRICK_MASK) & ~BRICK_MASK);
+
+	int numChunksX = (m_Width + chunkSize - 1) / chunkSize;
+	int numChunksY = (m_Length + chunkSize - 1) / chunkSize;
+
+	// The boxes of simplifyFoliage, mergeLiquids and createClipHull go to
+	// the chunk of their first block
+	vector < vector<mapBlock> > boxes(numChunksX * numChunksY);
+	for (int i = 0; i < m_Boxes.size(); i++)
+	{
+		const block & blk = m_Boxes[i].blck;
+		boxes[blk.x / chunkSize + (blk.y / chunkSize) * numChunksX].push_back(m_Boxes[i]);
+	}
+	vector<mapBlock>().swap(m_Boxes);
+
+	cout << "Merging and writing the map in chunks of " << chunkSize << "x" << chunkSize << " blocks..." << endl;
+
+	beginMapFile(mapname);
+	if (!m_OutFile)
+	{
+		cout << "--- ERROR: Could not write map file " << mapname << endl;
+		return false;
+	}
+
+	m_MergeDeadline = m_Budget[stageMerge] > 0 ? currentTime() + m_Budget[stageMerge] : 0;
+
+	int numVoxels = 0;
+	int numBrushes = 0;
+	int largestChunk = 0;
+	bool stopped = false;
+
+	for (int cy = 0; cy < numChunksY; cy++)
+	{
+		for (int cx = 0; cx < numChunksX; cx++)
+		{
+			int x0 = cx * chunkSize;
+			int x1 = min(x0 + chunkSize, m_Width);
+			int y0 = cy * chunkSize;
+			int y1 = min(y0 + chunkSize, m_Length);
+			const vector<mapBlock> & chunkBoxes = boxes[cx + cy * numChunksX];
+
+			// Count, then list the blocks of the chunk
+			int count = 0;
+			for (int z = 0; z < m_WorldZ; z++)
+			{
+				for (int y = y0; y < y1; y++)
+				{
+					count += compactRow<false>(x0, x1, y, z, 0, numVoxels);
+				}
+			}
+
+			m_BlockCollection.resize(count + chunkBoxes.size());
+			largestChunk = max(largestChunk, (int)m_BlockCollection.size());
+
+			int unused = 0;
+			mapBlock* out = m_BlockCollection.empty() ? 0 : &m_BlockCollection[0];
+			for (int z = 0; z < m_WorldZ; z++)
+			{
+				for (int y = y0; y < y1; y++)
+				{
+					out += compactRow<true>(x0, x1, y, z, out, unused);
+				}
+			}
+			copy(chunkBoxes.begin(), chunkBoxes.end(), m_BlockCollection.end() - chunkBoxes.size());
+
+			// A stopped merge writes the remaining chunks as they are
+			if (!stopped && !m_BlockCollection.empty())
+			{
+				m_Arena.reserve(m_BlockCollection.size() * (2 * sizeof(mergeCandidate) + sizeof(mapBlock)
+						+ 2 * sizeof(uint64_t) + 2 * sizeof(int) + 1) + 4096);
+
+				for (int axis = optimizeByX; axis <= optimizeByZ && !stopped; axis++)
+				{
+					Optimize(axis);
+					stopped = stageStopped();
+				}
+			}
+
+			for (int i = 0; i < m_BlockCollection.size(); i++)
+			{
+				const block & blk = m_BlockCollection[i].blck;
+				createBrush(blk.x, blk.y, blk.z, blk.width, blk.length, blk.height, blk.type,
+						m_BlockCollection[i].texturing);
+			}
+			numBrushes += m_BlockCollection.size();
+
+			m_BlockCollection.clear();
+		}
+	}
+
+	vector<mapBlock>().swap(m_BlockCollection);
+
+	cout << numVoxels << " blocks merged as " << numBrushes << " brushes in " << numChunksX * numChunksY
+			<< " chunks, at most " << largestChunk << " blocks at once" << endl;
+	if (stopped)
+	{
+		cout << "Merging stopped early, the remaining chunks are not merged" << endl;
+	}
+
+	endMapFile();
+	return true;
+}
+
+/*
+ * Writes the textured faces of the merged blocks as a binary little endian
+ * PLY mesh for a quick look at the result. Caulked faces and hints are left
+ * out, faces are grouped by material and every face has the index of its
+ * material, the names are listed in the header comments.
+ */
+void qine::createPreviewFile(std::string previewname)
+{
+	// Corners of the face on every side, counter-clockwise seen from
+	// outside, as 0 = low and 1 = high end of the block along x, y, z
+	static const int sides[6] = { xp, xm, yp, ym, zp, zm };
+	static const int corners[6][4][3] = {
+		{ { 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 }, { 1, 0, 1 } },
+		{ { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 } },
+		{ { 0, 1, 0 }, { 0, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0 } },
+		{ { 0, 0, 0 }, { 1, 0, 0 }, { 1, 0, 1 }, { 0, 0, 1 } },
+		{ { 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 } },
+		{ { 0, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 } }
+	};
+
+	double start = currentTime();
+
+	vector<const char*> materials;
+	vector< pair<int, int> > faces; // material, block * 6 + side
+
+	for (int i = 0; i < m_BlockCollection.size(); i++)
+	{
+		const mapBlock & mb = m_BlockCollection[i];
+		const char* textures[6];
+		int blockflags;
+
+		getTextures(mb.blck.type, mb.texturing, textures[0], textures[1], textures[2], textures[3],
+				textures[4], textures[5], blockflags);
+
+		for (int side = 0; side < 6; side++)
+		{
+			if ((mb.texturing & sides[side]) == 0)
+			{
+				continue;
+			}
+
+			int material = 0;
+			while (material < materials.size() && strcmp(materials[material], textures[side]) != 0)
+			{
+				material++;
+			}
+			if (material == materials.size())
+			{
+				materials.push_back(textures[side]);
+			}
+
+			faces.push_back(make_pair(material, i * 6 + side));
+		}
+	}
+
+	sort (faces.begin(), faces.end());
+
+	ofstream file (previewname.c_str(), ios::out|ios::binary|ios::trunc);
+	if (!file)
+	{
+		cout << "--- ERROR: Could not write preview " << previewname << endl;
+		return;
+	}
+
+	file << "ply" << endl << "format binary_little_endian 1.0" << endl;
+	for (int m = 0; m < materials.size(); m++)
+	{
+		file << "comment material " << m << " " << materials[m] << endl;
+	}
+	file << "element vertex " << faces.size() * 4 << endl;
+	file << "property float x" << endl << "property float y" << endl << "property float z" << endl;
+	file << "element face " << faces.size() << endl;
+	file << "property list uchar int vertex_indices" << endl;
+	file << "property int material" << endl;
+	file << "end_header" << endl;
+
+	vector<float> vertices(faces.size() * 4 * 3);
+	for (int f = 0; f < faces.size(); f++)
+	{
+		const block & b = m_BlockCollection[faces[f].second / 6].blck;
+		int side = faces[f].second % 6;
+
+		// z is the top of a block (see createBrush)
+		int x = b.x * m_Lod + m_OffsetX;
+		int y = b.y * m_Lod + m_OffsetY;
+		int top = (b.z + 1) * m_Lod - 1;
+		float low[3] = { (float)x * BRUSH_SIZE, (float)y * BRUSH_SIZE, (float)(top - b.height * m_Lod) * BRUSH_SIZE };
+		float high[3] = { (float)(x + b.width * m_Lod) * BRUSH_SIZE, (float)(y + b.length * m_Lod) * BRUSH_SIZE, (float)top * BRUSH_SIZE };
+
+		for (int c = 0; c < 4; c++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				vertices[(f * 4 + c) * 3 + axis] = corners[side][c][axis] ? high[axis] : low[axis];
+			}
+		}
+	}
+	if (!faces.empty())
+	{
+		file.write((const char*)&vertices[0], vertices.size() * sizeof(float));
+	}
+
+	// count, four indices and the material, packed
+	const int faceSize = 1 + 4 * sizeof(int32_t) + sizeof(int32_t);
+	vector<char> faceData(faces.size() * faceSize);
+	for (int f = 0; f < faces.size(); f++)
+	{
+		char* record = &faceData[f * faceSize];
+		int32_t indices[5] = { f * 4, f * 4 + 1, f * 4 + 2, f * 4 + 3, faces[f].first };
+
+		record[0] = 4;
+		memcpy(record + 1, indices, sizeof(indices));
+	}
+	if (!faces.empty())
+	{
+		file.write(&faceData[0], faceData.size());
+	}
+
+	file.close();
+
+	cout << "Preview written: " << faces.size() << " faces, " << materials.size() << " materials ("
+			<< currentTime() - start << " s)" << endl;
+}
+
+/*
+ * Predicts the cost of compiling the merged brushes for a sweep of hint
+ * sizes and blocksizes, without q3map2. Every candidate builds an axial
+ * BSP over the structural brush bounds the way q3map2 splits (blocksize
+ * planes, then hint planes, then brush faces), keeps the leaves with cells
+ * outside the brushes and counts the portals between them. The VIS cost of a leaf is its
+ * portals times the portals near it, leaves see about as far as their own
+ * size, so hints trade more portals for smaller leaves. The candidates
+ * run in parallel. With apply the cheapest blocksize is written to the
+ * map, the hint size can only be suggested since hints are placed before
+ * the flood fill.
+ */
+void qine::estimateCompileCost(bool apply)
+{
+	if (m_Spans.empty())
+	{
+		cout << "--- ERROR: The estimate needs the world, it cannot be made from the brush cache" << endl;
+		return;
+	}
+
+	double start = currentTime();
+
+	// Cells outside the structural brushes, all of them are inside the
+	// skybox the map gets sealed with so hidden hollows count as well.
+	// Detail blocks here are the ones that become structural brushes.
+	vector<unsigned char> open((size_t)m_Width * m_Length * m_WorldZ);
+	for (int z = 0; z < m_WorldZ; z++)
+	{
+		for (int y = 0; y < m_Length; y++)
+		{
+			for (int x = 0; x < m_Width; x++)
+			{
+				int type = (unsigned char)getBlockAtXYZ(m_Blocks, x, y, z);
+				open[((size_t)z * m_Length + y) * m_Width + x] = !isDetail(type);
+			}
+		}
+	}
+
+	bspEstimator::box world = {{ 0, 0, 0 }, { m_Width, m_Length, m_WorldZ }};
+	volumeSum openSum(m_Width, m_Length, m_WorldZ, &open[0]);
+
+	// Brush bounds in cells, z from the bottom cell (see createBrush)
+	vector<bspEstimator::box> brushes;
+	for (int i = 0; i < m_BlockCollection.size(); i++)
+	{
+		const block & b = m_BlockCollection[i].blck;
+		if (isDetail(b.type))
+		{
+			bspEstimator::box br = {{ b.x, b.y, b.z - b.height + 1 }, { b.x + b.width, b.y + b.length, b.z + 1 }};
+			brushes.push_back(br);
+		}
+	}
+
+	const int hintSizes[] = { 0, 8, 16, 32 };
+	const int blockSizes[] = { 512, 1024, 2048, 4096, 8192 };
+
+	vector<bspEstimator::result> results;
+	for (int h = 0; h < sizeof(hintSizes) / sizeof(hintSizes[0]); h++)
+	{
+		for (int b = 0; b < sizeof(blockSizes) / sizeof(blockSizes[0]); b++)
+		{
+			bspEstimator::result r;
+			r.hintSize = hintSizes[h];
+			r.blockSize = blockSizes[b];
+			results.push_back(r);
+		}
+	}
+
+	std::atomic<int> next(0);
+	vector<std::thread> workers;
+	for (int t = 1; t < min(m_Threads, (int)results.size()); t++)
+	{
+		workers.push_back(std::thread(&bspEstimator::sweep, world, &brushes, &openSum, BRUSH_SIZE * m_Lod, &results, &next));
+	}
+	bspEstimator::sweep(world, &brushes, &openSum, BRUSH_SIZE * m_Lod, &results, &next);
+	for (int t = 0; t < workers.size(); t++)
+	{
+		workers[t].join();
+	}
+
+	cout << "Compile cost estimate (" << brushes.size() << " structural brushes):" << endl;
+
+	int best = 0;
+	for (int i = 0; i < results.size(); i++)
+	{
+		cout << "  -h " << setw(2) << results[i].hintSize << " _blocksize " << setw(4) << results[i].blockSize
+				<< ": " << setw(7) << results[i].leaves << " leaves " << setw(7) << results[i].portals
+				<< " portals, cost " << results[i].cost << endl;
+
+		if (results[i].cost < results[best].cost)
+		{
+			best = i;
+		}
+	}
+
+	cout << "Cheapest: -h " << results[best].hintSize << " -B " << results[best].blockSize
+			<< " (" << currentTime() - start << " s)" << endl;
+
+	if (apply)
+	{
+		m_BlockSize = results[best].blockSize;
+		cout << "Using _blocksize " << m_BlockSize << endl;
+
+		if (results[best].hintSize != m_HintSize)
+		{
+			cout << "Run again with -h " << results[best].hintSize << " to use the cheapest hint size" << endl;
+		}
+	}
+}
+
+/*
+ * Creates one map per region (or one func_group per region if asFuncGroups
+ * is set) and a manifest with the bounds and brush count of every region.
+ * Brushes and hints are assigned to the region that contains their origin
+ * so a region can be compiled, cached and recombined on its own.
+ */
+void qine::createRegionMapFiles(std::string mapname, int regionSize, bool asFuncGroups)
+{
+	if (m_BlockCollection.size() == 0)
+	{
+		cout << "--- ERROR: There are no blocks in the collection" << endl;
+		return;
+	}
+
+	std::string basename = mapname;
+	if (basename.size() > 4 && basename.compare(basename.size() - 4, 4, ".map") == 0)
+	{
+		basename.erase(basename.size() - 4);
+	}
+
+	int numRegionsX = (m_Width + regionSize - 1) / regionSize;
+	int numRegionsY = (m_Length + regionSize - 1) / regionSize;
+	int numRegions = numRegionsX * numRegionsY;
+
+	vector < vector<int> > regionBrushes(numRegions);
+	vector < vector<int> > regionHints(numRegions);
+
+	for (int i = 0; i < m_BlockCollection.size(); i++)
+	{
+		int rx = min(m_BlockCollection[i].blck.x / regionSize, numRegionsX - 1);
+		int ry = min(m_BlockCollection[i].blck.y / regionSize, numRegionsY - 1);
+		regionBrushes[rx + ry * numRegionsX].push_back(i);
+	}
+
+	for (int z = 0; z < m_NumHints[2]; z++)
+	{
+		for (int y = 0; y < m_NumHints[1]; y++)
+		{
+			for (int x = 0; x < m_NumHints[0]; x++)
+			{
+				if (isHintVisible(x, y, z))
+				{
+					int rx = min(m_Hint3dArray[x][y][z].x / regionSize, numRegionsX - 1);
+					int ry = min(m_Hint3dArray[x][y][z].y / regionSize, numRegionsY - 1);
+					// Pack the hint index so it can be unpacked when writing
+					regionHints[rx + ry * numRegionsX].push_back(
+							x + (y + z * m_NumHints[1]) * m_NumHints[0]);
+				}
+			}
+		}
+	}
+
+	ofstream manifest((basename + ".regions").c_str());
+	manifest << "// qine region manifest" << endl;
+	manifest << "// name file minx miny minz maxx maxy maxz brushes hints" << endl;
+
+	cout << "Writing " << (asFuncGroups ? "region func_groups..." : "region map files...") << endl;
+
+	if (asFuncGroups)
+	{
+		m_OutFile.open(mapname.c_str());
+		m_OutFile << "{" << endl << "\"classname\" \"worldspawn\"" << endl;
+		writeWorldspawnKeys();
+		m_OutFile << "}" << endl;
+	}
+
+	int regionsWritten = 0;
+
+	for (int ry = 0; ry < numRegionsY; ry++)
+	{
+		for (int rx = 0; rx < numRegionsX; rx++)
+		{
+			vector<int> & brushes = regionBrushes[rx + ry * numRegionsX];
+			vector<int> & hints = regionHints[rx + ry * numRegionsX];
+
+			if (brushes.empty())
+			{
+				continue;
+			}
+
+			char name[64];
+			sprintf(name, "region_%d_%d", rx, ry);
+
+			std::string filename = asFuncGroups ? mapname : basename + "_" + name + ".map";
+
+			if (asFuncGroups)
+			{
+				m_OutFile << "{" << endl << "\"classname\" \"func_group\"" << endl;
+				m_OutFile << "\"_qine_region\" \"" << name << "\"" << endl;
+			}
+			else
+			{
+				m_OutFile.open(filename.c_str());
+				m_OutFile << "{" << endl << "\"classname\" \"worldspawn\"" << endl;
+				writeWorldspawnKeys();
+				m_OutFile << "\"_qine_region\" \"" << name << "\"" << endl;
+			}
+
+			// Bounds in map units, z is the top of a brush (see createBrush)
+			int minX = m_BlockCollection[brushes[0]].blck.x;
+			int minY = m_BlockCollection[brushes[0]].blck.y;
+			int minZ = m_BlockCollection[brushes[0]].blck.z - m_BlockCollection[brushes[0]].blck.height;
+			int maxX = minX;
+			int maxY = minY;
+			int maxZ = m_BlockCollection[brushes[0]].blck.z;
+
+			for (int i = 0; i < brushes.size(); i++)
+			{
+				const block & b = m_BlockCollection[brushes[i]].blck;
+
+				minX = min(minX, b.x);
+				minY = min(minY, b.y);
+				minZ = min(minZ, b.z - b.height);
+				maxX = max(maxX, b.x + b.width);
+				maxY = max(maxY, b.y + b.length);
+				maxZ = max(maxZ, b.z);
+
+				createBrush(b.x, b.y, b.z, b.width, b.length, b.height, b.type,
+						m_BlockCollection[brushes[i]].texturing);
+			}
+
+			for (int i = 0; i < hints.size(); i++)
+			{
+				int x = hints[i] % m_NumHints[0];
+				int y = (hints[i] / m_NumHints[0]) % m_NumHints[1];
+				int z = hints[i] / (m_NumHints[0] * m_NumHints[1]);
+				writeHintBrush(x, y, z);
+			}
+
+			m_OutFile << "}" << endl;
+
+			if (!asFuncGroups)
+			{
+				// Lights go with the region that contains them
+				for (int i = 0; i < m_Lights.size(); i++)
+				{
+					int lx = min((int)(m_Lights[i].x / (BRUSH_SIZE * m_Lod)) / regionSize, numRegionsX - 1);
+					int ly = min((int)(m_Lights[i].y / (BRUSH_SIZE * m_Lod)) / regionSize, numRegionsY - 1);
+					if (lx == rx && ly == ry)
+					{
+						writeLight(m_Lights[i]);
+					}
+				}
+				m_OutFile.close();
+			}
+
+			manifest << name << " " << filename << " "
+					<< (minX * m_Lod + m_OffsetX) * BRUSH_SIZE << " " << (minY * m_Lod + m_OffsetY) * BRUSH_SIZE << " "
+					<< ((minZ + 1) * m_Lod - 1) * BRUSH_SIZE << " "
+					<< (maxX * m_Lod + m_OffsetX) * BRUSH_SIZE << " " << (maxY * m_Lod + m_OffsetY) * BRUSH_SIZE << " "
+					<< ((maxZ + 1) * m_Lod - 1) * BRUSH_SIZE << " "
+					<< brushes.size() << " " << hints.size() << endl;
+
+			regionsWritten++;
+		}
+	}
+
+	if (asFuncGroups)
+	{
+		for (int i = 0; i < m_Lights.size(); i++)
+		{
+			writeLight(m_Lights[i]);
+		}
+		m_OutFile.close();
+	}
+
+	manifest.close();
+
+	cout << regionsWritten << " regions written, manifest: " << basename << ".regions" << endl;
+}
+
+/*
+ * Returns true if the hint at x,y,z (in hint coordinates) should be written
+ */
+bool qine::isHintVisible(int x, int y, int z)
+{
+	return !m_Hint3dArray[x][y][z].markedForDeletion
+			&& !m_Hint3dArray[x][y][z].markedForDeletion2;
+}
+
+/*
+ * Write the hint at x,y,z (in hint coordinates) to the file.
+ */
+void qine::writeHintBrush(int x, int y, int z)
+{
+	createBrush(
+			m_Hint3dArray[x][y][z].x,
+			m_Hint3dArray[x][y][z].y,
+			m_Hint3dArray[x][y][z].z,
+			m_Hint3dArray[x][y][z].width,
+			m_Hint3dArray[x][y][z].length,
+			m_Hint3dArray[x][y][z].height,
+			0xFFFF,
+			0xFF // all sides textured on hints
+			);
+}
+
+/*
+ * Writes a light entity
+ */
+void qine::writeLight(const light & l)
+{
+	char temp[256];
+	sprintf(temp, "{\n\"classname\" \"light\"\n\"origin\" \"%d %d %d\"\n\"light\" \"%d\"\n\"_color\" \"%.2f %.2f %.2f\"\n}\n",
+			(int)l.x + m_OffsetX * BRUSH_SIZE, (int)l.y + m_OffsetY * BRUSH_SIZE, (int)l.z,
+			(int)l.intensity, l.r, l.g, l.b);
+	m_OutFile << temp;
+}
+
+/*
+ * Writes the BSP compile keys of worldspawn that were set
+ */
+void qine::writeWorldspawnKeys()
+{
+	if (m_BlockSize > 0)
+	{
+		m_OutFile << "\"_blocksize\" \"" << m_BlockSize << " " << m_BlockSize << " " << m_BlockSize << "\"" << endl;
+	}
+	if (m_ChopSize > 0)
+	{
+		m_OutFile << "\"chopsize\" \"" << m_ChopSize << "\"" << endl;
+	}
+}
+
+/*
+ * Returns true if the block type gives light
+ */
+bool qine::isEmitter(int type)
+{
+	return (type == Torch ||
+			type == JackOLantern ||
+			type == GlowstoneBlock ||
+			type == Lava ||
+			type == StationaryLava
+			);
+}
+
+/*
+ * Adds a light emitter of the given type at x,y,z
+ */
+void qine::addEmitter(int x, int y, int z, int type)
+{
+	lightEmitter e;
+	e.x = x;
+	e.y = y;
+	e.z = z;
+
+	switch (type)
+	{
+	case Torch:
+		e.intensity = 200; e.r = 1.0f; e.g = 0.8f; e.b = 0.5f;
+		break;
+	case JackOLantern:
+		e.intensity = 250; e.r = 1.0f; e.g = 0.7f; e.b = 0.3f;
+		break;
+	case GlowstoneBlock:
+		e.intensity = 300; e.r = 1.0f; e.g = 0.9f; e.b = 0.6f;
+		break;
+	default: // lava surface
+		e.intensity = 40; e.r = 1.0f; e.g = 0.4f; e.b = 0.1f;
+		break;
+	}
+
+	m_Emitters.push_back(e);
+}
+
+/*
+ * Collects the cells that give light before filterBlocks removes torches
+ * and jack-o-lanterns. Glowstone and lava surfaces light the cell next to
+ * them that becomes air, so no light starts inside a brush.
+ */
+void qine::collectLights()
+{
+	m_Emitters.clear();
+
+	if (m_MaxLights == 0)
+	{
+		return;
+	}
+
+	// Sides a glowstone block can light, top first
+	const int sides[][3] = { { 0, 0, 1 }, { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, -1 } };
+
+	for (int b = 0; b < m_Blocks.brickCount(); b++)
+	{
+		brickGrid::brick & brk = m_Blocks.getBrick(b);
+
+		if (brk.isUniform() && !isEmitter(brk.value))
+		{
+			continue;
+		}
+
+		for (int i = 0; i < BRICK_VOLUME; i++)
+		{
+			int x = brk.x + (i & BRICK_MASK);
+			int y = brk.y + ((i >> BRICK_BITS) & BRICK_MASK);
+			int z = brk.z + (i >> (2 * BRICK_BITS));
+			int type = brk.isUniform() ? brk.value : brk.cells[i];
+
+			if (!isEmitter(type) || x >= m_Width || y >= m_Length || z >= m_WorldZ)
+			{
+				continue;
+			}
+
+			if (type == Torch || type == JackOLantern)
+			{
+				addEmitter(x, y, z, type);
+			}
+			else if (type == GlowstoneBlock)
+			{
+				for (int s = 0; s < 6; s++)
+				{
+					int nx = x + sides[s][0];
+					int ny = y + sides[s][1];
+					int nz = z + sides[s][2];
+
+					if (nx >= 0 && nx < m_Width && ny >= 0 && ny < m_Length && nz >= 0 && nz < m_WorldZ
+							&& !isConverted(getBlockAtXYZ(m_Blocks, nx, ny, nz)))
+					{
+						addEmitter(nx, ny, nz, type);
+						break;
+					}
+				}
+			}
+			else if (z + 1 < m_WorldZ && !isConverted(getBlockAtXYZ(m_Blocks, x, y, z + 1)))
+			{
+				addEmitter(x, y, z + 1, type);
+			}
+		}
+	}
+}
+
+/*
+ * Groups the reached emitters on a grid, doubling the grid size until
+ * there are at most m_MaxLights groups, and makes one light per group.
+ * The light is put on the emitter closest to the weighted centre of its
+ * group so it stays in the open, with the summed (capped) intensity and
+ * the average colour.
+ */
+void qine::clusterLights()
+{
+	m_Lights.clear();
+
+	// Emitters that were not reached are removed with their surroundings
+	vector<lightEmitter> emitters;
+	for (int i = 0; i < m_Emitters.size(); i++)
+	{
+		const lightEmitter & e = m_Emitters[i];
+		if (getBlockAtXYZ(m_CheckList, e.x, e.y, e.z) != 0)
+		{
+			emitters.push_back(e);
+		}
+	}
+
+	if (emitters.empty())
+	{
+		return;
+	}
+
+	vector< pair<uint64_t, int> > cells(emitters.size());
+	int cellSize = 1;
+	int numClusters;
+
+	for (;;)
+	{
+		for (int i = 0; i < emitters.size(); i++)
+		{
+			uint64_t key = ((uint64_t)(emitters[i].x / cellSize) << 42)
+					| ((uint64_t)(emitters[i].y / cellSize) << 21)
+					| (uint64_t)(emitters[i].z / cellSize);
+			cells[i] = make_pair(key, i);
+		}
+
+		sort (cells.begin(), cells.end());
+
+		numClusters = 0;
+		for (int i = 0; i < cells.size(); i++)
+		{
+			numClusters += (i == 0 || cells[i].first != cells[i - 1].first) ? 1 : 0;
+		}
+
+		if (numClusters <= m_MaxLights)
+		{
+			break;
+		}
+		cellSize *= 2;
+	}
+
+	for (int first = 0; first < cells.size(); )
+	{
+		int last = first;
+		while (last < cells.size() && cells[last].first == cells[first].first)
+		{
+			last++;
+		}
+
+		float weight = 0;
+		float cx = 0, cy = 0, cz = 0;
+		light l;
+		l.r = l.g = l.b = 0;
+
+		for (int i = first; i < last; i++)
+		{
+			const lightEmitter & e = emitters[cells[i].second];
+			weight += e.intensity;
+			cx += e.x * e.intensity;
+			cy += e.y * e.intensity;
+			cz += e.z * e.intensity;
+			l.r += e.r * e.intensity;
+			l.g += e.g * e.intensity;
+			l.b += e.b * e.intensity;
+		}
+
+		cx /= weight;
+		cy /= weight;
+		cz /= weight;
+
+		int closest = cells[first].second;
+		float closestDistance = -1;
+		for (int i = first; i < last; i++)
+		{
+			const lightEmitter & e = emitters[cells[i].second];
+			float distance = (e.x - cx) * (e.x - cx) + (e.y - cy) * (e.y - cy) + (e.z - cz) * (e.z - cz);
+			if (closestDistance < 0 || distance < closestDistance)
+			{
+				closest = cells[i].second;
+				closestDistance = distance;
+			}
+		}
+
+		// Cell z spans z - 1 to z in brush units (see createBrush)
+		l.x = (emitters[closest].x + 0.5f) * m_Lod * BRUSH_SIZE;
+		l.y = (emitters[closest].y + 0.5f) * m_Lod * BRUSH_SIZE;
+		l.z = ((emitters[closest].z + 0.5f) * m_Lod - 1) * BRUSH_SIZE;
+		l.intensity = min(weight, (float)LIGHT_MAX_INTENSITY);
+		l.r /= weight;
+		l.g /= weight;
+		l.b /= weight;
+		m_Lights.push_back(l);
+
+		first = last;
+	}
+
+	cout << emitters.size() << " light emitters clustered into " << m_Lights.size()
+			<< " lights (grid of " << cellSize << " blocks)" << endl;
+}
+
+/*
+ * Write one brush to the file.
+ */
+void qine::createBrush(int x, int y, int z, int length, int y_length, int height, int type, int texturing)
+{
+	int brushSize = BRUSH_SIZE;
+	int blockflags = 0;
+
+	const char* xp_tex;
+	const char* xn_tex;
+	const char* yp_tex;
+	const char* yn_tex;
+	const char* zp_tex;
+	const char* zn_tex;
 
 	getTextures(type, texturing, xp_tex, xn_tex, yp_tex, yn_tex, zp_tex, zn_tex, blockflags);
 
-	if(type == Hint) blockflags = 0;
+	if(type == Hint) blockflags = 0;
+
+	// Back to world coordinates, a block of the grids stands for m_Lod
+	// blocks of the world along every axis
+	x = x * m_Lod + m_OffsetX;
+	y = y * m_Lod + m_OffsetY;
+	z = (z + 1) * m_Lod - 1;
+	length *= m_Lod;
+	y_length *= m_Lod;
+	height *= m_Lod;
+
+	m_OutFile << "{" << endl;
+
+	char temp[512];
+	// left -x
+	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
+			x*brushSize, 0,0,
+			x*brushSize, 1,0,
+			x*brushSize, 0,1,
+			xn_tex, blockflags);
+
+	m_OutFile << temp;
+
+	// right +x
+	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
+			(x+length)*brushSize, 0,0,
+			(x+length)*brushSize, 0,1,
+			(x+length)*brushSize, 1,0,
+			xp_tex, blockflags);
+
+			m_OutFile << temp;
+
+	// front y-
+	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
+			0,y*brushSize, 0,
+			0,y*brushSize, 1,
+			1,y*brushSize, 0,
+			yn_tex, blockflags);
+
+			m_OutFile << temp;
+
+	// back y+
+	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
+			0, (y+y_length)*brushSize, 0,
+			1, (y+y_length)*brushSize, 0,
+			0, (y+y_length)*brushSize, 1,
+			yp_tex, blockflags);
+
+			m_OutFile << temp;
+
+	// bottom z-
+	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
+			0, 0, (z-height)*brushSize,
+			1, 0, (z-height)*brushSize,
+			0, 1, (z-height)*brushSize,
+			zn_tex, blockflags);
+
+			m_OutFile << temp;
+
+	// top z+
+	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
+			0, 0, z*brushSize,
+			0, 1, z*brushSize,
+			1, 0, z*brushSize,
+			zp_tex, blockflags);
+
+	m_OutFile << temp;
+
+	m_OutFile << "}" << endl;
+}
+
+void qine::getTextures(int type, int texturing, const char*& xp_tex, const char*& xn_tex, const char*& yp_tex, const char*& yn_tex, const char*& zp_tex, const char*& zn_tex, int &blockflags)
+{
+	const char* top;
+	const char* side;
+	const char* bottom;
+	blockflags = 0;
+	const char* caulk;
+
+
+
+	if (type == Water || type == StationaryWater) {
+		caulk = "minetex/water_invis";
+		blockflags = 134217728;
+	} else if (type == Clip) {
+		caulk = "common/clip";
+	} else {
+		caulk = "common/caulk";
+	}
+
+	if (m_DetailBrushes)
+	{
+		blockflags = 134217728;
+	}
+
+	switch (type) {
+	case Grass:
+		top = "minetex/minetex-000"; // Grass
+		side = "minetex/minetex-003"; // Grass dirt
+		bottom = "minetex/minetex-002"; // Dirt
+		break;
+
+	case Stone:
+		top = "minetex/minetex-001";
+		side = "minetex/minetex-001";
+		bottom = "minetex/minetex-001";
+		break;
+
+	case Dirt:
+		top = "minetex/minetex-002";
+		side = "minetex/minetex-002";
+		bottom = "minetex/minetex-002";
+		break;
+
+	case StationaryWater:
+	case Water:
+		top = "liquids/clear_calm1";
+		side = "liquids/clear_calm1";
+		bottom = "liquids/clear_calm1";
+		break;
+
+	case Lava:
+	case StationaryLava:
+		top = "liquids/lavahell_2000";
+		side = "liquids/lavahell_2000";
+		bottom = "liquids/lavahell_2000";
+		break;
+
+	case Wood:
+		blockflags = 134217728;
+		top = "minetex/minetex-021";
+		side = "minetex/minetex-020";
+		bottom = "minetex/minetex-021";
+		break;
+
+	case Leaves:
+		blockflags = 134217728;
+		top = "minetex/minetex-052";
+		side = "minetex/minetex-052";
+		bottom = "minetex/minetex-052";
+		break;
+
+	case Bedrock:
+		top = "minetex/minetex-016";
+		side = "minetex/minetex-016";
+		bottom = "minetex/minetex-016";
+		break;
+
+	case Gravel:
+	case Cobblestone:
+		top = "minetex/minetex-019";
+		side = "minetex/minetex-019";
+		bottom = "minetex/minetex-019";
+		break;
+
+	case Sand:
+		top = "minetex/minetex-018";
+		side = "minetex/minetex-018";
+		bottom = "minetex/minetex-018"; // Sand
+		break;
+
+	case GoldOre:
+		top = "minetex/minetex-032";
+		side = "minetex/minetex-032";
+		bottom = "minetex/minetex-032";
+		break;
+
+	case IronOre:
+		top = "minetex/minetex-033";
+		side = "minetex/minetex-033";
+		bottom = "minetex/minetex-033";
+		break;
+
+	case CoalOre:
+		top = "minetex/minetex-034";
+		side = "minetex/minetex-034";
+		bottom = "minetex/minetex-034";
+		break;
+
+	case Clip:
+		top = "common/clip";
+		side = "common/clip";
+		bottom = "common/clip";
+		break;
+
+	case Caulk:
+		top = "common/caulk";
+		side = "common/caulk";
+		bottom = "common/caulk";
+		break;
+
+	case Hint:
+		top = "common/hint";
+		side = "common/hint";
+		bottom = "common/hint";
+		break;
+
+	default:
+		top = "minetex/minetex-024";
+		side = "minetex/minetex-024";
+		bottom = "minetex/minetex-024";
+		break;
+	}
+
+	  // caulk x+
+	if ((texturing & xp) == 0)
+		xp_tex = caulk;
+	else
+		xp_tex = side;
+
+	// caulk x-
+	if ((texturing & xm) == 0)
+		xn_tex = caulk;
+	else
+		xn_tex = side;
+
+	//  y+
+	if ((texturing & yp) == 0)
+		yp_tex = caulk;
+	else
+		yp_tex = side;
+
+	// y-
+	if ((texturing & ym) == 0)
+		yn_tex = caulk;
+	else
+		yn_tex = side;
+
+	// z+
+	if ((texturing & zp) == 0) {
+		zp_tex = caulk;
+	}
+	else {
+		zp_tex = top;
+	}
+
+	 // z-
+	if ((texturing & zm) == 0)
+		zn_tex = caulk;
+	else
+		zn_tex = bottom;
+}
+
+std::atomic<bool> progress::s_Cancelled(false);
+
+void progress::begin(const char* stage, long total, double deadline)
+{
+	m_Stage = stage;
+	m_Total = max(1L, total);
+	m_Start = currentTime();
+	m_Deadline = deadline;
+	m_NextReport = m_Start + 1;
+	m_Stopped = false;
+}
+
+/*
+ * Checks the clock and the cancel flag, prints the progress once a second
+ */
+bool progress::poll(long done)
+{
+	double now = currentTime();
+
+	if (s_Cancelled || (m_Deadline > 0 && now > m_Deadline))
+	{
+		if (!m_Stopped)
+		{
+			cout << m_Stage << ": " << (s_Cancelled ? "cancelled" : "out of time") << " at "
+					<< 100 * done / m_Total << " %" << endl;
+		}
+		m_Stopped = true;
+		return false;
+	}
+
+	if (now >= m_NextReport)
+	{
+		cout << m_Stage << ": " << 100 * done / m_Total << " % ("
+				<< (long)(done / (now - m_Start)) << " per second)" << endl;
+		m_NextReport = now + 1;
+	}
+	return true;
+}
+
+/*
+ * Creates a grid of sizeX*sizeY*sizeZ cells, all set to 0.
+ */
+brickGrid::brickGrid(int sizeX, int sizeY, int sizeZ)
+{
+	int bricksX = (sizeX + BRICK_SIZE - 1) >> BRICK_BITS;
+	int bricksY = (sizeY + BRICK_SIZE - 1) >> BRICK_BITS;
+	int bricksZ = (sizeZ + BRICK_SIZE - 1) >> BRICK_BITS;
+
+	// Morton codes of all bricks are below the code of the last brick in
+	// the power of two box around them
+	int spanX = 1, spanY = 1, spanZ = 1;
+	while (spanX < bricksX) spanX <<= 1;
+	while (spanY < bricksY) spanY <<= 1;
+	while (spanZ < bricksZ) spanZ <<= 1;
+
+	m_Bricks.resize(slot(spanX - 1, spanY - 1, spanZ - 1) + 1);
+
+	for (int i = 0; i < m_Bricks.size(); i++)
+	{
+		int bx = 0, by = 0, bz = 0;
+		for (int bit = 0; bit < 10; bit++)
+		{
+			bx |= ((i >> (3 * bit)) & 1) << bit;
+			by |= ((i >> (3 * bit + 1)) & 1) << bit;
+			bz |= ((i >> (3 * bit + 2)) & 1) << bit;
+		}
+
+		if (bx < bricksX && by < bricksY && bz < bricksZ)
+		{
+			m_Bricks[i].x = bx << BRICK_BITS;
+			m_Bricks[i].y = by << BRICK_BITS;
+			m_Bricks[i].z = bz << BRICK_BITS;
+			m_Order.push_back(i);
+		}
+	}
+}
+
+/*
+ * Spreads the lower 10 bits of v to every third bit.
+ */
+unsigned int brickGrid::spreadBits(unsigned int v)
+{
+	v &= 0x3FF;
+	v = (v | (v << 16)) & 0x030000FF;
+	v = (v | (v << 8)) & 0x0300F00F;
+	v = (v | (v << 4)) & 0x030C30C3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+/*
+ * Copies n cells of row y,z starting at x0 to out
+ */
+void brickGrid::getRow(int x0, int y, int z, int n, unsigned char* out)
+{
+	int x = x0;
+	while (x < x0 + n)
+	{
+		const brick & b = brickAt(x, y, z);
+		int count = min((x | BRICK_MASK) + 1, x0 + n) - x;
+
+		if (b.isUniform())
+		{
+			memset(out + x - x0, b.value, count);
+		}
+		else
+		{
+			memcpy(out + x - x0, &b.cells[cellIndex(x, y, z)], count);
+		}
+		x += count;
+	}
+}
+
+/*
+ * Makes the brick uniform with the given value and frees its cells.
+ */
+void brickGrid::fill(brick & b, unsigned char value)
+{
+	vector<unsigned char>().swap(b.cells);
+	b.value = value;
+}
+
+/*
+ * Turns the brick uniform if all its cells have the same value.
+ * Returns true if the brick is uniform.
+ */
+bool brickGrid::compact(brick & b)
+{
+	if (b.cells.empty())
+	{
+		return true;
+	}
+
+	for (int i = 1; i < BRICK_VOLUME; i++)
+	{
+		if (b.cells[i] != b.cells[0])
+		{
+			return false;
+		}
+	}
+
+	fill(b, b.cells[0]);
+	return true;
+}
+
+/*
+ * Returns the number of uniform bricks.
+ */
+int brickGrid::uniformBricks() const
+{
+	int uniform = 0;
+	for (int i = 0; i < m_Order.size(); i++)
+	{
+		if (m_Bricks[m_Order[i]].isUniform()) uniform++;
+	}
+	return uniform;
+}
+
+/*
+ * Returns the approximate number of bytes used by the grid.
+ */
+size_t brickGrid::memoryUsage() const
+{
+	size_t bytes = m_Bricks.size() * sizeof(brick) + m_Order.size() * sizeof(int);
+	for (int i = 0; i < m_Order.size(); i++)
+	{
+		bytes += m_Bricks[m_Order[i]].cells.capacity();
+	}
+	return bytes;
+}
+
+/*
+ * Builds all levels of the pyramid over the sizeX x sizeY x sizeZ blocks
+ * of grid, classes gives the open and solid bits of every value. Level 1
+ * is read from the bricks by reduceBricks, every further level is
+ * reduced from the one below it.
+ */
+void occupancyPyramid::build(brickGrid & grid, int sizeX, int sizeY, int sizeZ, const unsigned char* classes)
+{
+	m_Grid = &grid;
+	m_Size[0] = sizeX;
+	m_Size[1] = sizeY;
+	m_Size[2] = sizeZ;
+	memcpy(m_Classes, classes, sizeof(m_Classes));
+	m_Levels.clear();
+
+	int size[3] = { sizeX, sizeY, sizeZ };
+
+	while (size[0] > 1 || size[1] > 1 || size[2] > 1)
+	{
+		level next;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			next.size[axis] = (size[axis] + 1) / 2;
+			size[axis] = next.size[axis];
+		}
+
+		int cells = next.size[0] * next.size[1] * next.size[2];
+		for (int b = 0; b < 3; b++)
+		{
+			next.bits[b].assign((cells + 63) / 64, 0);
+		}
+		next.values.assign(cells, 0);
+
+		if (m_Levels.empty())
+		{
+			reduceBricks(grid, next);
+			m_Levels.push_back(next);
+			continue;
+		}
+
+		const level & below = m_Levels.back();
+
+		for (int z = 0; z < next.size[2]; z++)
+		{
+			for (int y = 0; y < next.size[1]; y++)
+			{
+				for (int x = 0; x < next.size[0]; x++)
+				{
+					int found = 0;
+					bool same = true;
+					int value = -1;
+
+					for (int c = 0; c < 8; c++)
+					{
+						int cx = 2 * x + (c & 1), cy = 2 * y + ((c >> 1) & 1), cz = 2 * z + (c >> 2);
+						if (cx >= below.size[0] || cy >= below.size[1] || cz >= below.size[2]) continue;
+
+						int j = below.index(cx, cy, cz);
+						found |= (below.test(openBit, j) ? open : 0) | (below.test(solidBit, j) ? solid : 0);
+						same = same && below.test(sameBit, j) && (value < 0 || below.values[j] == value);
+						value = below.values[j];
+					}
+
+					next.store(next.index(x, y, z), found, same, value);
+				}
+			}
+		}
+
+		m_Levels.push_back(next);
+	}
+}
+
+/*
+ * Fills level 1 from the bricks of grid, one brick of 8^3 cells at a
+ * time. A uniform brick stores one value everywhere. A brick inside the
+ * world ORs the classes and ANDs the compares of the 2^3 blocks of every
+ * cell without a branch, only the bricks cut by the world border check
+ * every block against it.
+ */
+void occupancyPyramid::reduceBricks(brickGrid & grid, level & first) const
+{
+	const int half = BRICK_SIZE / 2;
+	const int corners[8] = {
+		0, 1, BRICK_SIZE, BRICK_SIZE + 1,
+		BRICK_SIZE * BRICK_SIZE, BRICK_SIZE * BRICK_SIZE + 1,
+		BRICK_SIZE * BRICK_SIZE + BRICK_SIZE, BRICK_SIZE * BRICK_SIZE + BRICK_SIZE + 1
+	};
+
+	for (int b = 0; b < grid.brickCount(); b++)
+	{
+		const brickGrid::brick & brk = grid.getBrick(b);
+		int x0 = brk.x / 2, y0 = brk.y / 2, z0 = brk.z / 2;
+		int nx = min(half, first.size[0] - x0);
+		int ny = min(half, first.size[1] - y0);
+		int nz = min(half, first.size[2] - z0);
+
+		bool inside = brk.x + BRICK_SIZE <= m_Size[0] && brk.y + BRICK_SIZE <= m_Size[1]
+				&& brk.z + BRICK_SIZE <= m_Size[2];
+
+		for (int z = 0; z < nz; z++)
+		{
+			for (int y = 0; y < ny; y++)
+			{
+				int i = first.index(x0, y0 + y, z0 + z);
+
+				if (brk.isUniform())
+				{
+					for (int x = 0; x < nx; x++)
+					{
+						first.store(i + x, m_Classes[brk.value], 1, brk.value);
+					}
+				}
+				else if (inside)
+				{
+					const unsigned char* row = &brk.cells[brickGrid::cellIndex(0, 2 * y, 2 * z)];
+					for (int x = 0; x < half; x++)
+					{
+						const unsigned char* cell = row + 2 * x;
+						int found = 0;
+						int same = 1;
+						for (int c = 0; c < 8; c++)
+						{
+							found |= m_Classes[cell[corners[c]]];
+							same &= cell[corners[c]] == cell[0];
+						}
+						first.store(i + x, found, same, cell[0]);
+					}
+				}
+				else
+				{
+					for (int x = 0; x < nx; x++)
+					{
+						int found = 0;
+						bool same = true;
+						int value = -1;
+
+						for (int c = 0; c < 8; c++)
+						{
+							int cx = brk.x + 2 * x + (c & 1), cy = brk.y + 2 * y + ((c >> 1) & 1), cz = brk.z + 2 * z + (c >> 2);
+							if (cx >= m_Size[0] || cy >= m_Size[1] || cz >= m_Size[2]) continue;
+
+							int v = brk.cells[brickGrid::cellIndex(cx, cy, cz)];
+							found |= m_Classes[v];
+							same = same && (value < 0 || v == value);
+							value = v;
+						}
+
+						first.store(i + x, found, same, value);
+					}
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Returns true if some block in [lo, hi) has one of the classes in what
+ */
+bool occupancyPyramid::any(int what, const int* lo, const int* hi) const
+{
+	if (m_Grid == 0)
+	{
+		return false;
+	}
+
+	int box[2][3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		box[0][axis] = max(lo[axis], 0);
+		box[1][axis] = min(hi[axis], m_Size[axis]);
+		if (box[0][axis] >= box[1][axis])
+		{
+			return false;
+		}
+	}
+
+	// Start at the top, a single cell unless the world is one block
+	int l = m_Levels.size();
+	int shift = l;
+	for (int z = box[0][2] >> shift; z <= (box[1][2] - 1) >> shift; z++)
+	{
+		for (int y = box[0][1] >> shift; y <= (box[1][1] - 1) >> shift; y++)
+		{
+			for (int x = box[0][0] >> shift; x <= (box[1][0] - 1) >> shift; x++)
+			{
+				if (search(l, x, y, z, what, box[0], box[1]))
+				{
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Looks for a block of class what in cell x, y, z of level l, which
+ * overlaps the box [lo, hi)
+ */
+bool occupancyPyramid::search(int l, int x, int y, int z, int what, const int* lo, const int* hi) const
+{
+	if (l == 0)
+	{
+		return (m_Classes[m_Grid->get(x, y, z)] & what) != 0;
+	}
 
-	m_OutFile << "{" << endl;
+	const level & cell = m_Levels[l - 1];
+	int i = cell.index(x, y, z);
 
-	char temp[512];
-	// left -x
-	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
-			x*brushSize, 0,0,
-			x*brushSize, 1,0,
-			x*brushSize, 0,1,
-			xn_tex.c_str(), blockflags);
+	int found = (cell.test(openBit, i) ? open : 0) | (cell.test(solidBit, i) ? solid : 0);
+	if ((found & what) == 0)
+	{
+		return false;
+	}
 
-	m_OutFile << temp;
+	// All blocks of the cell are alike, or all are in the box
+	int pos[3] = { x << l, y << l, z << l };
+	bool inside = true;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		inside = inside && pos[axis] >= lo[axis] && pos[axis] + (1 << l) <= hi[axis];
+	}
+	if (inside || cell.test(sameBit, i))
+	{
+		return true;
+	}
 
-	// right +x
-	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
-			(x+length)*brushSize, 0,0,
-			(x+length)*brushSize, 0,1,
-			(x+length)*brushSize, 1,0,
-			xp_tex.c_str(), blockflags);
+	for (int c = 0; c < 8; c++)
+	{
+		int cx = 2 * x + (c & 1), cy = 2 * y + ((c >> 1) & 1), cz = 2 * z + (c >> 2);
+		int child[3] = { cx << (l - 1), cy << (l - 1), cz << (l - 1) };
+		bool overlaps = true;
 
-			m_OutFile << temp;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			overlaps = overlaps && child[axis] < hi[axis] && child[axis] + (1 << (l - 1)) > lo[axis];
+		}
 
-	// front y-
-	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
-			0,y*brushSize, 0,
-			0,y*brushSize, 1,
-			1,y*brushSize, 0,
-			yn_tex.c_str(), blockflags);
+		if (overlaps && search(l - 1, cx, cy, cz, what, lo, hi))
+		{
+			return true;
+		}
+	}
 
-			m_OutFile << temp;
+	return false;
+}
 
-	// back y+
-	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
-			0, (y+y_length)*brushSize, 0,
-			1, (y+y_length)*brushSize, 0,
-			0, (y+y_length)*brushSize, 1,
-			yp_tex.c_str(), blockflags);
+/*
+ * Creates an empty arena, memory is taken in blocks of at least blockSize.
+ */
+arena::arena(size_t blockSize) : m_BlockSize(blockSize), m_Current(0), m_Offset(0), m_Used(0), m_Peak(0)
+{
+}
+
+arena::~arena()
+{
+	for (int i = 0; i < m_Blocks.size(); i++)
+	{
+		free(m_Blocks[i].data);
+	}
+}
+
+/*
+ * Returns bytes from the arena, they stay valid until they are released.
+ */
+void* arena::allocate(size_t bytes, size_t align)
+{
+	size_t offset = (m_Offset + align - 1) & ~(align - 1);
+
+	if (m_Blocks.empty() || offset + bytes > m_Blocks[m_Current].size)
+	{
+		nextBlock(bytes + align);
+		offset = (m_Offset + align - 1) & ~(align - 1);
+	}
+
+	m_Used += offset + bytes - m_Offset;
+	m_Peak = max(m_Peak, m_Used);
+	m_Offset = offset + bytes;
+
+	return m_Blocks[m_Current].data + offset;
+}
+
+/*
+ * Makes sure the next bytes allocated fit in one block.
+ */
+void arena::reserve(size_t bytes)
+{
+	if (m_Blocks.empty() || m_Offset + bytes > m_Blocks[m_Current].size)
+	{
+		nextBlock(bytes);
+	}
+}
+
+/*
+ * Moves on to a block with room for bytes, reusing blocks that were
+ * released before allocating a new one.
+ */
+void arena::nextBlock(size_t bytes)
+{
+	int next = m_Blocks.empty() ? 0 : m_Current + 1;
+
+	if (next >= m_Blocks.size() || m_Blocks[next].size < bytes)
+	{
+		arenaBlock block;
+		block.size = max(bytes, m_BlockSize);
+		block.data = (char*)malloc(block.size);
+		m_Blocks.insert(m_Blocks.begin() + next, block);
+	}
+
+	if (!m_Blocks.empty() && next > 0)
+	{
+		// The rest of the current block is skipped
+		m_Used += m_Blocks[m_Current].size - m_Offset;
+	}
+
+	m_Current = next;
+	m_Offset = 0;
+}
+
+/*
+ * Returns the current position, everything allocated after it can be
+ * given back at once with release.
+ */
+arena::marker arena::mark() const
+{
+	marker m;
+	m.block = m_Current;
+	m.offset = m_Offset;
+	m.used = m_Used;
+	return m;
+}
+
+void arena::release(const marker & m)
+{
+	m_Current = m.block;
+	m_Offset = m.offset;
+	m_Used = m.used;
+}
+
+size_t arena::capacity() const
+{
+	size_t bytes = 0;
+	for (int i = 0; i < m_Blocks.size(); i++)
+	{
+		bytes += m_Blocks[i].size;
+	}
+	return bytes;
+}
+
+/*
+ * Returns the cache key for the current input file and pipeline options.
+ * Output-only options (regions, texturing) are deliberately not part of it.
+ */
+uint64_t qine::computeCacheKey()
+{
+	// FNV-1a over the input bytes followed by the options
+	uint64_t hash = FNV_OFFSET_BASIS;
+
+	if (m_LevelFile)
+	{
+		hash = hashBytes(hash, m_LevelFile->data(), m_LevelFile->size());
+	}
+	else
+	{
+		ifstream file (m_DatName.c_str(), ios::in|ios::binary);
+		char buffer[65536];
+
+		while (file)
+		{
+			file.read(buffer, sizeof(buffer));
+			hash = hashBytes(hash, buffer, file.gcount());
+		}
+
+		file.close();
+	}
+
+	int options[] = { BRUSH_CACHE_VERSION, m_Width, m_Length, m_HintSize, m_WorldX, m_WorldY, m_WorldZ, m_MaxLights,
+			m_OffsetX, m_OffsetY, m_FillHidden, m_CanopyBoxes, m_MergeLiquids, m_Lod,
+			m_ClipHull };
+	hash = hashBytes(hash, options, sizeof(options));
+
+	return hash;
+}
+
+/*
+ * Writes the merged blocks (with their face masks) and the hint set to a
+ * binary cache file. The file is a header followed by fixed size records so
+ * that it can be mapped and read in place.
+ */
+void qine::saveBrushCache(std::string cachename)
+{
+	std::string data;
+	writeBrushCache(data);
+
+	ofstream file (cachename.c_str(), ios::out|ios::binary|ios::trunc);
+	if (!file)
+	{
+		cout << "--- ERROR: Could not write brush cache " << cachename << endl;
+		return;
+	}
+
+	file.write(data.data(), data.size());
+	file.close();
+
+	const cacheHeader* header = (const cacheHeader*)data.data();
+	cout << "Brush cache written: " << header->numBlocks << " blocks, "
+			<< header->numHintsX * header->numHintsY * header->numHintsZ << " hints, "
+			<< header->numLights << " lights" << endl;
+}
+
+/*
+ * Appends the brush cache of saveBrushCache to data
+ */
+void qine::writeBrushCache(std::string & data)
+{
+	cacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "QBC\0", 4);
+	header.version = BRUSH_CACHE_VERSION;
+	header.key = computeCacheKey();
+	header.numBlocks = m_BlockCollection.size();
+	header.numHintsX = m_NumHints[0];
+	header.numHintsY = m_NumHints[1];
+	header.numHintsZ = m_NumHints[2];
+	header.hintSize = m_HintSize;
+	header.numLights = m_Lights.size();
+
+	data.append((char*)&header, sizeof(header));
+
+	for (int i = 0; i < m_BlockCollection.size(); i++)
+	{
+		cacheBlock record;
+		record.x = m_BlockCollection[i].blck.x;
+		record.y = m_BlockCollection[i].blck.y;
+		record.z = m_BlockCollection[i].blck.z;
+		record.width = m_BlockCollection[i].blck.width;
+		record.length = m_BlockCollection[i].blck.length;
+		record.height = m_BlockCollection[i].blck.height;
+		record.type = m_BlockCollection[i].blck.type;
+		record.texturing = m_BlockCollection[i].texturing;
+		data.append((char*)&record, sizeof(record));
+	}
+
+	// Hints are stored x fastest, then y, then z
+	for (int z = 0; z < header.numHintsZ; z++)
+	{
+		for (int y = 0; y < header.numHintsY; y++)
+		{
+			for (int x = 0; x < header.numHintsX; x++)
+			{
+				hintBrush & hint = m_Hint3dArray[x][y][z];
+				cacheHint record;
+				record.x = hint.x;
+				record.y = hint.y;
+				record.z = hint.z;
+				record.width = hint.width;
+				record.length = hint.length;
+				record.height = hint.height;
+				record.flags = (hint.markedForDeletion ? 1 : 0) | (hint.markedForDeletion2 ? 2 : 0);
+				data.append((char*)&record, sizeof(record));
+			}
+		}
+	}
+
+	for (int i = 0; i < m_Lights.size(); i++)
+	{
+		cacheLight record;
+		record.x = m_Lights[i].x;
+		record.y = m_Lights[i].y;
+		record.z = m_Lights[i].z;
+		record.intensity = m_Lights[i].intensity;
+		record.r = m_Lights[i].r;
+		record.g = m_Lights[i].g;
+		record.b = m_Lights[i].b;
+		data.append((char*)&record, sizeof(record));
+	}
+}
+
+/*
+ * Maps the cache file and, if it was written by this version for the same
+ * input and options, fills the block collection and hints from it.
+ * Returns false if there is no usable cache.
+ */
+bool qine::loadBrushCache(std::string cachename)
+{
+	int fd = open(cachename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(cacheHeader))
+	{
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+
+	bool valid = readBrushCache((const char*)data, st.st_size, cachename);
+
+	munmap(data, st.st_size);
+	return valid;
+}
+
+/*
+ * Fills the block collection, hints and lights from a brush cache in
+ * memory if it was written by this version for the same input and
+ * options. Returns false if it is not usable.
+ */
+bool qine::readBrushCache(const char* data, size_t size, std::string cachename)
+{
+	if (size < sizeof(cacheHeader))
+	{
+		return false;
+	}
+
+	const cacheHeader* header = (const cacheHeader*)data;
+	bool valid = memcmp(header->magic, "QBC\0", 4) == 0 && header->version == BRUSH_CACHE_VERSION;
+
+	if (!valid)
+	{
+		cout << "Brush cache " << cachename << " has an unknown format, ignoring it" << endl;
+	}
+	else if (header->key != computeCacheKey())
+	{
+		cout << "Brush cache " << cachename << " is stale (input or options changed)" << endl;
+		valid = false;
+	}
+	else
+	{
+		size_t expectedSize = sizeof(cacheHeader)
+				+ (size_t)header->numBlocks * sizeof(cacheBlock)
+				+ (size_t)header->numHintsX * header->numHintsY * header->numHintsZ * sizeof(cacheHint)
+				+ (size_t)header->numLights * sizeof(cacheLight);
+		if (size != expectedSize)
+		{
+			cout << "Brush cache " << cachename << " is truncated, ignoring it" << endl;
+			valid = false;
+		}
+	}
+
+	if (valid)
+	{
+		const cacheBlock* blocks = (const cacheBlock*)(header + 1);
+		const cacheHint* hints = (const cacheHint*)(blocks + header->numBlocks);
+
+		m_BlockCollection.clear();
+		m_BlockCollection.reserve(header->numBlocks);
+
+		for (int i = 0; i < header->numBlocks; i++)
+		{
+			block blk(blocks[i].x, blocks[i].y, blocks[i].z, blocks[i].type);
+			blk.width = blocks[i].width;
+			blk.length = blocks[i].length;
+			blk.height = blocks[i].height;
+			m_BlockCollection.push_back(mapBlock(blk, blocks[i].texturing));
+		}
+
+		m_NumHints[0] = header->numHintsX;
+		m_NumHints[1] = header->numHintsY;
+		m_NumHints[2] = header->numHintsZ;
+
+		m_Hint3dArray.resize(header->numHintsX);
+		for (int x = 0; x < header->numHintsX; x++)
+		{
+			m_Hint3dArray[x].resize(header->numHintsY);
+			for (int y = 0; y < header->numHintsY; y++)
+			{
+				m_Hint3dArray[x][y].resize(header->numHintsZ);
+			}
+		}
+
+		for (int z = 0; z < header->numHintsZ; z++)
+		{
+			for (int y = 0; y < header->numHintsY; y++)
+			{
+				for (int x = 0; x < header->numHintsX; x++)
+				{
+					const cacheHint & record = *hints++;
+					hintBrush & hint = m_Hint3dArray[x][y][z];
+					hint = hintBrush(record.x, record.y, record.z, record.width, record.length, record.height);
+					hint.markedForDeletion = (record.flags & 1) != 0;
+					hint.markedForDeletion2 = (record.flags & 2) != 0;
+				}
+			}
+		}
+
+		const cacheLight* lights = (const cacheLight*)hints;
+
+		m_Lights.resize(header->numLights);
+		for (int i = 0; i < header->numLights; i++)
+		{
+			m_Lights[i].x = lights[i].x;
+			m_Lights[i].y = lights[i].y;
+			m_Lights[i].z = lights[i].z;
+			m_Lights[i].intensity = lights[i].intensity;
+			m_Lights[i].r = lights[i].r;
+			m_Lights[i].g = lights[i].g;
+			m_Lights[i].b = lights[i].b;
+		}
+
+		cout << "Using brush cache " << cachename << ": " << m_BlockCollection.size() << " blocks" << endl;
+	}
+
+	return valid;
+}
+
+/*
+ * Returns the text between the quotes of the n-th quoted string in line
+ */
+static std::string quoted(const std::string & line, int n)
+{
+	size_t start = 0;
+	for (int i = 0; i <= n; i++)
+	{
+		start = line.find('"', start);
+		if (start == std::string::npos) return "";
+		size_t end = line.find('"', start + 1);
+		if (end == std::string::npos) return "";
+		if (i == n) return line.substr(start + 1, end - start - 1);
+		start = end + 1;
+	}
+	return "";
+}
+
+/*
+ * Returns the textures of the six sides and the content flags as one key
+ */
+static std::string textureKey(const char* const* shaders, int flags)
+{
+	std::string key;
+	for (int s = 0; s < 6; s++)
+	{
+		key += shaders[s];
+		key += ' ';
+	}
+	char number[16];
+	sprintf(number, "%d", flags);
+	return key + number;
+}
+
+/*
+ * Reads the entities of a .map file. Worldspawn brushes that are axis
+ * aligned boxes on the block grid, written the way createBrush writes
+ * them, are read into brushes. Everything else is kept as text and is
+ * written back as it was by createMapFile.
+ */
+bool qine::readMap(std::string mapname, sourceMap & source)
+{
+	ifstream file (mapname.c_str());
+	if (!file)
+	{
+		cout << "--- ERROR: Could not open " << mapname << endl;
+		return false;
+	}
+
+	for (int a = 0; a < 3; a++)
+	{
+		source.lo[a] = INT_MAX;
+		source.hi[a] = INT_MIN;
+	}
+
+	std::string line;
+	std::string entity;
+	std::string brush;
+	vector<std::string> brushes;
+	vector< pair<std::string, std::string> > keys;
+	bool worldspawn = false;
+	bool hadWorldspawn = false;
+	int depth = 0;
+
+	while (getline(file, line))
+	{
+		if (line.length() > 0 && line[line.length() - 1] == '\r')
+		{
+			line.erase(line.length() - 1);
+		}
+
+		size_t first = line.find_first_not_of(" \t");
+		std::string trimmed = (first == std::string::npos) ? "" : line.substr(first);
+
+		if (trimmed == "{")
+		{
+			depth++;
+		}
+
+		if (depth == 0)
+		{
+			continue;
+		}
+
+		entity += line + "\n";
+		if (depth >= 2)
+		{
+			brush += line + "\n";
+		}
+		else if (trimmed.length() > 0 && trimmed[0] == '"')
+		{
+			std::string key = quoted(trimmed, 0);
+			if (key == "classname")
+			{
+				worldspawn = quoted(trimmed, 1) == "worldspawn" && !hadWorldspawn;
+			}
+			else
+			{
+				keys.push_back(make_pair(key, quoted(trimmed, 1)));
+			}
+		}
+
+		if (trimmed != "}")
+		{
+			continue;
+		}
+
+		depth--;
+		if (depth == 1)
+		{
+			brushes.push_back(brush);
+			brush.clear();
+		}
+		else if (depth == 0)
+		{
+			if (worldspawn)
+			{
+				hadWorldspawn = true;
+				source.keys = keys;
+
+				for (int i = 0; i < brushes.size(); i++)
+				{
+					sourceBrush b;
 
-			m_OutFile << temp;
+					// Block z is the top of a brush, it starts at -1
+					if (!parseBrush(brushes[i], b) || b.lo[2] < -BRUSH_SIZE)
+					{
+						source.brushText += brushes[i];
+						continue;
+					}
 
-	// bottom z-
-	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
-			0, 0, (z-height)*brushSize,
-			1, 0, (z-height)*brushSize,
-			0, 1, (z-height)*brushSize,
-			zn_tex.c_str(), blockflags);
+					for (int a = 0; a < 3; a++)
+					{
+						int shift = (a == 2) ? 1 : 0;
+						source.lo[a] = min(source.lo[a], b.lo[a] / BRUSH_SIZE + shift);
+						source.hi[a] = max(source.hi[a], b.hi[a] / BRUSH_SIZE + shift);
+					}
+					source.brushes.push_back(b);
+				}
+			}
+			else
+			{
+				source.entities += entity;
+			}
 
-			m_OutFile << temp;
+			entity.clear();
+			brushes.clear();
+			keys.clear();
+			worldspawn = false;
+		}
+	}
 
-	// top z+
-	sprintf(temp, "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s 0 0 0 0.25 0.25 %d 0 0\n",
-			0, 0, z*brushSize,
-			0, 1, z*brushSize,
-			1, 0, z*brushSize,
-			zp_tex.c_str(), blockflags);
+	if (depth != 0)
+	{
+		cout << "--- ERROR: " << mapname << " ends inside an entity" << endl;
+		return false;
+	}
 
-	m_OutFile << temp;
+	if (source.brushes.empty())
+	{
+		cout << "--- ERROR: There are no axis aligned brushes in " << mapname << endl;
+		return false;
+	}
 
-	m_OutFile << "}" << endl;
+	cout << "Read " << source.brushes.size() << " axis aligned brushes from " << mapname << endl;
+	return true;
 }
 
-void qine::getTextures(int type, int texturing, string& xp_tex, string& xn_tex, string& yp_tex, string& yn_tex, string& zp_tex, string& zn_tex, int &blockflags)
+/*
+ * Reads a brush written by createBrush: six axis aligned planes on the
+ * block grid, one per side, with the default texture alignment and the
+ * same content flags on all sides. Returns false for any other brush.
+ */
+bool qine::parseBrush(const std::string & text, sourceBrush & brush)
 {
-	string top;
-	string side;
-	string bottom;
-	blockflags = 0;
-	string caulk;
+	istringstream in (text);
+	std::string line;
+	int sides = 0;
 
+	while (getline(in, line))
+	{
+		size_t first = line.find_first_not_of(" \t");
+		if (first == std::string::npos || line[first] == '{' || line[first] == '}')
+		{
+			continue;
+		}
 
+		double p[3][3];
+		double offsetX, offsetY, rotation, scaleX, scaleY;
+		int flags, surfaceFlags, value;
+		char shader[256];
+		int end = 0;
 
-	if (type == Water || type == StationaryWater) {
-		caulk = "minetex/water_invis";
-		blockflags = 134217728;
-	} else {
-		caulk = "common/caulk";
-	}
+		if (sscanf(line.c_str(), " ( %lf %lf %lf ) ( %lf %lf %lf ) ( %lf %lf %lf ) %255s %lf %lf %lf %lf %lf %d %d %d %n",
+				&p[0][0], &p[0][1], &p[0][2], &p[1][0], &p[1][1], &p[1][2], &p[2][0], &p[2][1], &p[2][2],
+				shader, &offsetX, &offsetY, &rotation, &scaleX, &scaleY, &flags, &surfaceFlags, &value, &end) != 18
+				|| end != line.length())
+		{
+			return false;
+		}
 
-	if (m_HintSize > 0)
-	{
-		blockflags = 134217728;
-	}
+		if (offsetX != 0 || offsetY != 0 || rotation != 0 || scaleX != 0.25 || scaleY != 0.25
+				|| surfaceFlags != 0 || value != 0 || (sides != 0 && flags != brush.flags))
+		{
+			return false;
+		}
 
-	switch (type) {
-	case Grass:
-		top = "minetex/minetex-000"; // Grass
-		side = "minetex/minetex-003"; // Grass dirt
-		bottom = "minetex/minetex-002"; // Dirt
-		break;
+		// The plane faces away from (p2 - p0) x (p1 - p0)
+		double u[3], v[3], normal[3];
+		for (int a = 0; a < 3; a++)
+		{
+			u[a] = p[2][a] - p[0][a];
+			v[a] = p[1][a] - p[0][a];
+		}
+		normal[0] = u[1] * v[2] - u[2] * v[1];
+		normal[1] = u[2] * v[0] - u[0] * v[2];
+		normal[2] = u[0] * v[1] - u[1] * v[0];
 
-	case Stone:
-		top = "minetex/minetex-001";
-		side = "minetex/minetex-001";
-		bottom = "minetex/minetex-001";
-		break;
+		int axis = -1;
+		for (int a = 0; a < 3; a++)
+		{
+			if (normal[a] == 0) continue;
+			if (axis >= 0) return false;
+			axis = a;
+		}
 
-	case Dirt:
-		top = "minetex/minetex-002";
-		side = "minetex/minetex-002";
-		bottom = "minetex/minetex-002";
-		break;
+		double position = p[0][axis];
+		if (axis < 0 || position != floor(position) || (int)position % BRUSH_SIZE != 0)
+		{
+			return false;
+		}
 
-	case StationaryWater:
-	case Water:
-		top = "liquids/clear_calm1";
-		side = "liquids/clear_calm1";
-		bottom = "liquids/clear_calm1";
-		break;
+		int side = axis * 2 + (normal[axis] < 0 ? 1 : 0);
+		if (sides & (1 << side))
+		{
+			return false;
+		}
+		sides |= 1 << side;
 
-	case Lava:
-	case StationaryLava:
-		top = "liquids/lavahell_2000";
-		side = "liquids/lavahell_2000";
-		bottom = "liquids/lavahell_2000";
-		break;
+		if (normal[axis] > 0)
+		{
+			brush.hi[axis] = (int)position;
+		}
+		else
+		{
+			brush.lo[axis] = (int)position;
+		}
+		brush.shaders[side] = shader;
+		brush.flags = flags;
+	}
 
-	case Wood:
-		blockflags = 134217728;
-		top = "minetex/minetex-021";
-		side = "minetex/minetex-020";
-		bottom = "minetex/minetex-021";
-		break;
+	if (sides != 0x3F)
+	{
+		return false;
+	}
 
-	case Leaves:
-		blockflags = 134217728;
-		top = "minetex/minetex-052";
-		side = "minetex/minetex-052";
-		bottom = "minetex/minetex-052";
-		break;
+	for (int a = 0; a < 3; a++)
+	{
+		if (brush.lo[a] >= brush.hi[a]) return false;
+	}
 
-	case Bedrock:
-		top = "minetex/minetex-016";
-		side = "minetex/minetex-016";
-		bottom = "minetex/minetex-016";
-		break;
+	brush.text = text;
+	return true;
+}
 
-	case Gravel:
-	case Cobblestone:
-		top = "minetex/minetex-019";
-		side = "minetex/minetex-019";
-		bottom = "minetex/minetex-019";
-		break;
+/*
+ * Puts the brushes of a map read by readMap back into the block grid.
+ * The textures of a brush give its block type and textured sides, but
+ * only the outer blocks of the brush get the textured sides. Brushes
+ * with textures createBrush does not write are kept for createMapFile,
+ * like the hints of the map, which replace the hints of this map.
+ */
+void qine::rasterizeMap(const sourceMap & source)
+{
+	// Every look createBrush can give a block without hints, the first
+	// type wins if several types look the same. Clip boxes overlap the
+	// terrain, so they are kept as they are.
+	m_DetailBrushes = false;
+	map<std::string, pair<int, int> > looks;
+	for (int type = Air + 1; type < 256; type++)
+	{
+		if (type == Clip) continue;
 
-	case Sand:
-		top = "minetex/minetex-018";
-		side = "minetex/minetex-018";
-		bottom = "minetex/minetex-018"; // Sand
-		break;
+		for (int texturing = 0; texturing < 64; texturing++)
+		{
+			const char* shaders[6];
+			int flags;
+			getTextures(type, texturing, shaders[0], shaders[1], shaders[2], shaders[3], shaders[4], shaders[5], flags);
+			looks.insert(make_pair(textureKey(shaders, flags), make_pair(type, texturing)));
+		}
+	}
 
-	case GoldOre:
-		top = "minetex/minetex-032";
-		side = "minetex/minetex-032";
-		bottom = "minetex/minetex-032";
-		break;
+	m_DetailBrushes = m_HintSize > 0;
 
-	case IronOre:
-		top = "minetex/minetex-033";
-		side = "minetex/minetex-033";
-		bottom = "minetex/minetex-033";
-		break;
+	int numBlocks = 0;
+	int copied = 0;
 
-	case CoalOre:
-		top = "minetex/minetex-034";
-		side = "minetex/minetex-034";
-		bottom = "minetex/minetex-034";
-		break;
+	for (int i = 0; i < source.brushes.size(); i++)
+	{
+		const sourceBrush & b = source.brushes[i];
 
-	case Hint:
-		top = "common/hint";
-		side = "common/hint";
-		bottom = "common/hint";
-		break;
+		const char* shaders[6];
+		for (int s = 0; s < 6; s++)
+		{
+			shaders[s] = b.shaders[s].c_str();
+		}
 
-	default:
-		top = "minetex/minetex-024";
-		side = "minetex/minetex-024";
-		bottom = "minetex/minetex-024";
-		break;
-	}
+		// A map written with hints has detail brushes all over, so does this one then
+		map<std::string, pair<int, int> >::const_iterator look = looks.find(textureKey(shaders, b.flags));
+		if (look == looks.end() && b.flags == 134217728)
+		{
+			look = looks.find(textureKey(shaders, 0));
+			m_DetailBrushes |= look != looks.end();
+		}
+		if (look == looks.end())
+		{
+			m_SourceBrushes += b.text;
+			copied++;
+			continue;
+		}
 
-	  // caulk x+
-	if ((texturing & xp) == 0)
-		xp_tex = caulk;
-	else
-		xp_tex = side;
+		int type = look->second.first;
+		int texturing = look->second.second;
 
-	// caulk x-
-	if ((texturing & xm) == 0)
-		xn_tex = caulk;
-	else
-		xn_tex = side;
+		int x0 = b.lo[0] / BRUSH_SIZE - m_OffsetX;
+		int x1 = b.hi[0] / BRUSH_SIZE - m_OffsetX;
+		int y0 = b.lo[1] / BRUSH_SIZE - m_OffsetY;
+		int y1 = b.hi[1] / BRUSH_SIZE - m_OffsetY;
+		int z0 = b.lo[2] / BRUSH_SIZE + 1;
+		int z1 = b.hi[2] / BRUSH_SIZE + 1;
 
-	//  y+
-	if ((texturing & yp) == 0)
-		yp_tex = caulk;
-	else
-		yp_tex = side;
+		for (int z = z0; z < z1; z++)
+		{
+			for (int y = y0; y < y1; y++)
+			{
+				for (int x = x0; x < x1; x++)
+				{
+					int outer = (x == x1 - 1 ? xp : 0) | (x == x0 ? xm : 0)
+							| (y == y1 - 1 ? yp : 0) | (y == y0 ? ym : 0)
+							| (z == z1 - 1 ? zp : 0) | (z == z0 ? zm : 0);
 
-	// y-
-	if ((texturing & ym) == 0)
-		yn_tex = caulk;
-	else
-		yn_tex = side;
+					m_Blocks.set(x, y, z, type);
+					m_TextureList.set(x, y, z, texturing & outer);
+					numBlocks++;
+				}
+			}
+		}
+	}
 
-	// z+
-	if ((texturing & zp) == 0) {
-		zp_tex = caulk;
+	for (int b = 0; b < m_Blocks.brickCount(); b++)
+	{
+		brickGrid::compact(m_Blocks.getBrick(b));
+		brickGrid::compact(m_TextureList.getBrick(b));
 	}
-	else {
-		zp_tex = top;
+
+	for (int x = 0; x < m_NumHints[0]; x++)
+	{
+		for (int y = 0; y < m_Hint3dArray[x].size(); y++)
+		{
+			for (int z = 0; z < m_Hint3dArray[x][y].size(); z++)
+			{
+				m_Hint3dArray[x][y][z].markedForDeletion = true;
+			}
+		}
 	}
 
-	 // z-
-	if ((texturing & zm) == 0)
-		zn_tex = caulk;
-	else
-		zn_tex = bottom;
+	m_SourceKeys = source.keys;
+	m_SourceBrushes += source.brushText;
+	m_SourceEntities = source.entities;
+
+	cout << source.brushes.size() - copied << " brushes rasterised into " << numBlocks << " blocks, "
+			<< copied << " brushes with other textures copied" << endl;
 }
 
 void qine::printLayer(int a_z, int size) {
@@ -1058,5 +5785,85 @@ int qine::blockCount()
 	return m_BlockCollection.size();
 }
 
+size_t qine::arenaPeak()
+{
+	return m_Arena.peak();
+}
+
+void qine::setThreads(int threads)
+{
+	m_Threads = max(1, threads);
+}
+
+void qine::setMaxLights(int maxLights)
+{
+	m_MaxLights = max(0, maxLights);
+}
+
+void qine::setFillHidden(bool fill)
+{
+	m_FillHidden = fill;
+}
+
+void qine::setCanopyBoxes(int boxes)
+{
+	m_CanopyBoxes = max(0, boxes);
+}
+
+void qine::setMergeLiquids(bool merge)
+{
+	m_MergeLiquids = merge;
+}
+
+void qine::setClipHull(bool hull)
+{
+	m_ClipHull = hull;
+}
+
+/*
+ * Returns the number of caulk blocks filling the hidden volume
+ */
+int qine::hiddenBlockCount()
+{
+	int count = 0;
+	for (int i = 0; i < m_BlockCollection.size(); i++)
+	{
+		count += (m_BlockCollection[i].blck.type == Caulk) ? 1 : 0;
+	}
+	return count;
+}
+
+/*
+ * Returns the number of clip blocks of the player collision hull
+ */
+int qine::clipBlockCount()
+{
+	int count = 0;
+	for (int i = 0; i < m_BlockCollection.size(); i++)
+	{
+		count += (m_BlockCollection[i].blck.type == Clip) ? 1 : 0;
+	}
+	return count;
+}
+
+void qine::setBlockSize(int blockSize, int chopSize)
+{
+	m_BlockSize = max(0, blockSize);
+	m_ChopSize = max(0, chopSize);
+}
+
+void qine::setBudget(int stage, double seconds)
+{
+	m_Budget[stage] = seconds;
+}
+
+/*
+ * Returns true if the last stage stopped early, cancelled or out of time
+ */
+bool qine::stageStopped()
+{
+	return m_Progress.stopped();
+}
+
 } /* namespace qine */
 
@@ -8,14 +8,32 @@
 #ifndef QINE_H_
 #define QINE_H_
 
+// Default world dimensions, see -d
 #define WORLD_X 256
 #define WORLD_Y 256
 #define WORLD_Z 64
 
+#define BRUSH_SIZE 64
+
+#define BRUSH_CACHE_VERSION 3
+
+#define BRICK_BITS 4
+#define BRICK_SIZE (1 << BRICK_BITS)
+#define BRICK_MASK (BRICK_SIZE - 1)
+#define BRICK_VOLUME (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <list>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <string>
 
 using namespace std;
 
@@ -27,6 +45,379 @@ enum optimizeBy {
 
 namespace qine {
 
+/*
+ * Sparse voxel storage. The grid is split in BRICK_SIZE^3 bricks kept in
+ * Morton order, a brick where all cells have the same value only stores
+ * that value (uniform) and has no cell array.
+ */
+class brickGrid {
+public:
+	struct brick {
+		int x; // first cell of the brick
+		int y;
+		int z;
+		unsigned char value; // value of all cells if uniform
+		vector<unsigned char> cells; // empty if uniform
+
+		brick() : x(0), y(0), z(0), value(0) {};
+
+		bool isUniform() const { return cells.empty(); }
+	};
+
+	brickGrid(int sizeX, int sizeY, int sizeZ);
+
+	unsigned char get(int x, int y, int z) const
+	{
+		const brick & b = m_Bricks[slot(x >> BRICK_BITS, y >> BRICK_BITS, z >> BRICK_BITS)];
+		return b.cells.empty() ? b.value : b.cells[cellIndex(x, y, z)];
+	}
+
+	void set(int x, int y, int z, unsigned char value)
+	{
+		brick & b = m_Bricks[slot(x >> BRICK_BITS, y >> BRICK_BITS, z >> BRICK_BITS)];
+		if (b.cells.empty())
+		{
+			if (b.value == value) return;
+			b.cells.assign(BRICK_VOLUME, b.value);
+		}
+		b.cells[cellIndex(x, y, z)] = value;
+	}
+
+	// Bricks in Morton order
+	int brickCount() const { return m_Order.size(); }
+	brick & getBrick(int i) { return m_Bricks[m_Order[i]]; }
+
+	// Brick containing cell x,y,z
+	brick & brickAt(int x, int y, int z) { return m_Bricks[slot(x >> BRICK_BITS, y >> BRICK_BITS, z >> BRICK_BITS)]; }
+
+	static int cellIndex(int x, int y, int z)
+	{
+		return (x & BRICK_MASK) | ((y & BRICK_MASK) << BRICK_BITS) | ((z & BRICK_MASK) << (2 * BRICK_BITS));
+	}
+
+	void getRow(int x0, int y, int z, int n, unsigned char* out);
+
+	static void fill(brick & b, unsigned char value);
+	static bool compact(brick & b);
+
+	int uniformBricks() const;
+	size_t memoryUsage() const;
+
+private:
+	static unsigned int spreadBits(unsigned int v);
+
+	int slot(int bx, int by, int bz) const
+	{
+		return spreadBits(bx) | (spreadBits(by) << 1) | (spreadBits(bz) << 2);
+	}
+
+	vector<brick> m_Bricks; // indexed by Morton code, holes are unused
+	vector<int> m_Order;    // used slots in Morton order
+};
+
+/*
+ * Mip pyramid over a brickGrid. Level l has one cell per 2^l blocks along
+ * every axis and keeps three bits per cell in bitsets: some block of the
+ * cell is open, some block is solid, and all blocks have the same value.
+ * What is open and solid is given per value when the pyramid is built.
+ * Level 0 is the grid itself, so a box query only visits the cells of
+ * the coarsest levels that are partly inside the box or mixed.
+ */
+class occupancyPyramid {
+public:
+	enum { open = 1, solid = 2 };
+
+	occupancyPyramid() : m_Grid(0) {};
+
+	void build(brickGrid & grid, int sizeX, int sizeY, int sizeZ, const unsigned char* classes);
+	bool any(int what, const int* lo, const int* hi) const;
+
+private:
+	enum { openBit, solidBit, sameBit };
+
+	struct level {
+		int size[3];
+		vector<uint64_t> bits[3];
+		vector<unsigned char> values; // value of the blocks if they are all the same
+
+		int index(int x, int y, int z) const { return x + (y + z * size[1]) * size[0]; }
+		bool test(int b, int i) const { return (bits[b][i >> 6] >> (i & 63)) & 1; }
+		void mark(int b, int i) { bits[b][i >> 6] |= (uint64_t)1 << (i & 63); }
+
+		// Sets the bits of cell i without branches, same is 0 or 1
+		void store(int i, int found, int same, int value)
+		{
+			bits[openBit][i >> 6] |= (uint64_t)(found & open) << (i & 63);
+			bits[solidBit][i >> 6] |= (uint64_t)((found & solid) >> 1) << (i & 63);
+			bits[sameBit][i >> 6] |= (uint64_t)same << (i & 63);
+			values[i] = value & -same;
+		}
+	};
+
+	void reduceBricks(brickGrid & grid, level & first) const;
+	bool search(int l, int x, int y, int z, int what, const int* lo, const int* hi) const;
+
+	brickGrid* m_Grid;
+	int m_Size[3];
+	unsigned char m_Classes[256];
+	vector<level> m_Levels; // levels 1 and up
+};
+
+/*
+ * Monotonic allocator for the scratch memory of one conversion. Memory is
+ * handed out from large blocks and only given back all at once, to a
+ * marker (release). Released blocks are kept for the next passes.
+ */
+class arena {
+public:
+	struct marker {
+		int block;
+		size_t offset;
+		size_t used;
+	};
+
+	arena(size_t blockSize = 1 << 22);
+	~arena();
+
+	void* allocate(size_t bytes, size_t align);
+	void reserve(size_t bytes);
+
+	marker mark() const;
+	void release(const marker & m);
+
+	size_t peak() const { return m_Peak; }
+	size_t capacity() const;
+
+private:
+	struct arenaBlock {
+		char* data;
+		size_t size;
+	};
+
+	void nextBlock(size_t bytes);
+
+	arena(const arena &);
+	arena & operator=(const arena &);
+
+	vector<arenaBlock> m_Blocks;
+	size_t m_BlockSize;
+	int m_Current;
+	size_t m_Offset;
+	size_t m_Used;
+	size_t m_Peak;
+};
+
+/*
+ * Standard allocator on top of an arena, deallocate does nothing.
+ */
+template <class T>
+struct arenaAllocator {
+	typedef T value_type;
+
+	arena* m_Arena;
+
+	arenaAllocator(arena & a) : m_Arena(&a) {};
+	template <class U> arenaAllocator(const arenaAllocator<U> & other) : m_Arena(other.m_Arena) {};
+
+	T* allocate(size_t n) { return (T*)m_Arena->allocate(n * sizeof(T), __alignof__(T)); }
+	void deallocate(T*, size_t) {};
+
+	template <class U> bool operator==(const arenaAllocator<U> & other) const { return m_Arena == other.m_Arena; }
+	template <class U> bool operator!=(const arenaAllocator<U> & other) const { return m_Arena != other.m_Arena; }
+};
+
+template <class T>
+struct arenaVector {
+	typedef vector<T, arenaAllocator<T> > type;
+};
+
+/*
+ * Releases everything allocated from the arena in the enclosing scope.
+ */
+class arenaScope {
+public:
+	arenaScope(arena & a) : m_Arena(a), m_Marker(a.mark()) {};
+	~arenaScope() { m_Arena.release(m_Marker); }
+private:
+	arena & m_Arena;
+	arena::marker m_Marker;
+};
+
+/*
+ * Queue of at most capacity items between pipeline stages. push waits
+ * while it is full, pop waits while it is empty and returns false once
+ * it is closed and drained.
+ */
+template <class T>
+class boundedQueue {
+public:
+	boundedQueue(int capacity) : m_Capacity(capacity), m_Closed(false) {};
+
+	void push(const T & item)
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		while (m_Items.size() >= m_Capacity)
+		{
+			m_NotFull.wait(lock);
+		}
+		m_Items.push_back(item);
+		m_NotEmpty.notify_one();
+	}
+
+	bool pop(T & item)
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		while (m_Items.empty() && !m_Closed)
+		{
+			m_NotEmpty.wait(lock);
+		}
+		if (m_Items.empty())
+		{
+			return false;
+		}
+		item = m_Items.front();
+		m_Items.pop_front();
+		m_NotFull.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_Closed = true;
+		m_NotEmpty.notify_all();
+	}
+
+private:
+	std::deque<T> m_Items;
+	size_t m_Capacity;
+	bool m_Closed;
+	std::mutex m_Mutex;
+	std::condition_variable m_NotFull;
+	std::condition_variable m_NotEmpty;
+};
+
+/*
+ * Byte strings by key for the server. The least recently used entries are
+ * dropped while the total size is above the capacity, an entry that is
+ * still in use stays alive until its last user lets go of it.
+ */
+class blobCache {
+public:
+	typedef std::shared_ptr<const std::string> blob;
+
+	blobCache(size_t capacity) : m_Capacity(capacity), m_Size(0), m_Hits(0), m_Misses(0) {};
+
+	blob get(const std::string & key)
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		std::map<std::string, entryList::iterator>::iterator it = m_Index.find(key);
+		if (it == m_Index.end())
+		{
+			m_Misses++;
+			return blob();
+		}
+		m_Hits++;
+		m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+		return it->second->second;
+	}
+
+	void put(const std::string & key, blob value)
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		std::map<std::string, entryList::iterator>::iterator it = m_Index.find(key);
+		if (it != m_Index.end())
+		{
+			m_Size -= it->second->second->size();
+			m_Entries.erase(it->second);
+			m_Index.erase(it);
+		}
+
+		m_Entries.push_front(std::make_pair(key, value));
+		m_Index[key] = m_Entries.begin();
+		m_Size += value->size();
+
+		while (m_Size > m_Capacity && m_Entries.size() > 1)
+		{
+			m_Size -= m_Entries.back().second->size();
+			m_Index.erase(m_Entries.back().first);
+			m_Entries.pop_back();
+		}
+	}
+
+	void print()
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		std::cout << "Server cache: " << m_Entries.size() << " entries, " << m_Size / (1024 * 1024) << " of "
+				<< m_Capacity / (1024 * 1024) << " MB, " << m_Hits << " hits, " << m_Misses << " misses" << std::endl;
+	}
+
+private:
+	typedef std::list< std::pair<std::string, blob> > entryList;
+
+	entryList m_Entries; // most recently used first
+	std::map<std::string, entryList::iterator> m_Index;
+	size_t m_Capacity;
+	size_t m_Size;
+	int m_Hits;
+	int m_Misses;
+	std::mutex m_Mutex;
+};
+
+/*
+ * Progress of a long stage. Reports percent done and rate about once a
+ * second and tells the stage to stop when the run is cancelled or the
+ * stage is past its deadline. update is cheap enough to call per item.
+ */
+class progress {
+public:
+	progress() : m_Stage(""), m_Total(0), m_Start(0), m_Deadline(0), m_NextReport(0), m_Stopped(false) {};
+
+	void begin(const char* stage, long total, double deadline);
+
+	bool update(long done)
+	{
+		return (done & 1023) != 0 || poll(done);
+	}
+
+	bool stopped() const { return m_Stopped; }
+
+	static void cancel() { s_Cancelled = true; }
+	static bool cancelled() { return s_Cancelled; }
+
+private:
+	bool poll(long done);
+
+	const char* m_Stage;
+	long m_Total;
+	double m_Start;
+	double m_Deadline; // 0 for no deadline
+	double m_NextReport;
+	bool m_Stopped;
+
+	static std::atomic<bool> s_Cancelled;
+};
+
+/*
+ * Layout of the level data, x fastest, then y, then z. Power of two
+ * sizes are indexed with shifts, levelLayout<0, 0> works for any size.
+ */
+template <int BITS_X, int BITS_Y>
+struct levelLayout {
+	levelLayout(int sizeX, int sizeY) {};
+	int index(int x, int y, int z) const { return x | (y << BITS_X) | (z << (BITS_X + BITS_Y)); }
+	int stepZ() const { return 1 << (BITS_X + BITS_Y); }
+};
+
+template <>
+struct levelLayout<0, 0> {
+	int sizeX;
+	int sizeY;
+	levelLayout(int sizeX, int sizeY) : sizeX(sizeX), sizeY(sizeY) {};
+	int index(int x, int y, int z) const { return x + (y + z * sizeY) * sizeX; }
+	int stepZ() const { return sizeX * sizeY; }
+};
+
 class qine {
 
 	enum blockType {
@@ -128,6 +519,9 @@ class qine {
 		LockedChest,
 		Trapdoor,
 
+		Clip = 0xfd, // player collision hull, see createClipHull
+		Caulk = 0xfe, // hidden volume, see removeUncheckedBlocks
+
 		Hint = 0xffff
 	};
 
@@ -165,7 +559,8 @@ class qine {
 		bool markedForDeletion;
 		bool markedForDeletion2;
 
-		hintBrush() {};
+		hintBrush() : x(0), y(0), z(0), width(0), length(0), height(0),
+			markedForDeletion(false), markedForDeletion2(false) {};
 		hintBrush(int x, int y, int z, int width, int length, int height) :
 			x(x), y(y), z(z), width(width), length(length), height(height),
 			markedForDeletion(false), markedForDeletion2(false){};
@@ -174,15 +569,35 @@ class qine {
 
 	};
 
-	struct position {
+	// Run of blocks of one type in a column, z0 to z1 inclusive
+	struct span {
+		short z0;
+		short z1;
+		unsigned char type;
+		span(int z0, int z1, int type) : z0(z0), z1(z1), type(type) {};
+	};
+
+	// Cell that gives light, collected before filtering
+	struct lightEmitter {
 		int x;
 		int y;
 		int z;
-		int direction;
-		char lastType;
-		position(int x, int y, int z, int dir, char lastType) :
-			x(x), y(y), z(z), direction(dir), lastType(lastType) {};
- 	};
+		float intensity;
+		float r;
+		float g;
+		float b;
+	};
+
+	// Light entity in map units, a cluster of emitters
+	struct light {
+		float x;
+		float y;
+		float z;
+		float intensity;
+		float r;
+		float g;
+		float b;
+	};
 
 	struct texturing {
 		bool top;
@@ -196,6 +611,50 @@ class qine {
 		texturing(bool b) : top(b), bot(b), lft(b), rgt(b), bck(b), fnt(b) {};
 	};
 
+	// On-disk layout of the brush cache, all records are fixed size
+	struct cacheHeader {
+		char magic[4];
+		uint32_t version;
+		uint64_t key;
+		uint32_t numBlocks;
+		uint32_t numHintsX;
+		uint32_t numHintsY;
+		uint32_t numHintsZ;
+		uint32_t hintSize;
+		uint32_t numLights; // cacheLight records after the hints
+	};
+
+	struct cacheBlock {
+		int32_t x;
+		int32_t y;
+		int32_t z;
+		int32_t width;
+		int32_t length;
+		int32_t height;
+		int32_t type;
+		int32_t texturing;
+	};
+
+	struct cacheHint {
+		int32_t x;
+		int32_t y;
+		int32_t z;
+		int32_t width;
+		int32_t length;
+		int32_t height;
+		int32_t flags; // 1 = markedForDeletion, 2 = markedForDeletion2
+	};
+
+	struct cacheLight {
+		float x;
+		float y;
+		float z;
+		float intensity;
+		float r;
+		float g;
+		float b;
+	};
+
 public:
 	struct mapBlock {
 		block blck;
@@ -205,37 +664,116 @@ public:
 	};
 
 public:
-	qine(std::string datname, int width, int height, int hintSize);
+	qine(std::string datname, int width, int height, int hintSize,
+			int worldX = WORLD_X, int worldY = WORLD_Y, int worldZ = WORLD_Z,
+			int offsetX = 0, int offsetY = 0, int lod = 1);
 	virtual ~qine();
 
+	bool loadWorld();
+	bool readLevel();
+	void decodeLevel();
+
 	void filterBlocks();
 	int createBlockList();
 	void createMapFile(std::string);
+	bool createChunkedMapFile(std::string mapname, int chunkSize);
+	void createRegionMapFiles(std::string mapname, int regionSize, bool asFuncGroups);
+	void createPreviewFile(std::string previewname);
+
+	void estimateCompileCost(bool apply);
+	void setBlockSize(int blockSize, int chopSize);
+	void setFillHidden(bool fill);
+	void setCanopyBoxes(int boxes);
+	void setMergeLiquids(bool merge);
+	void setClipHull(bool hull);
 
 	void createBrush(int x, int y, int z, int length, int y_length, int height, int type, int texturing);
 
-	void checkBlockList();
+	bool checkBlockList();
 
 	void createHints();
 	void MergeHints();
-	void markHintForDeletion(int x, int y, int z);
 	void removeUselessHints();
 
 	int Optimize(int direction);
 
 	void removeUncheckedBlocks();
+	void simplifyFoliage();
+	void mergeLiquids();
+	void createClipHull();
 	void printLayer(int z, int size);
 
 	int blockCount();
+	int hiddenBlockCount();
+	int clipBlockCount();
+	size_t arenaPeak();
+
+	void setThreads(int threads);
+	void setMaxLights(int maxLights);
+
+	void collectLights();
+	void clusterLights();
+
+	// Stages with a time budget
+	enum stage { stageCheck, stageMerge, numStages };
+	void setBudget(int stage, double seconds);
+	bool stageStopped();
+
+	void saveBrushCache(std::string cachename);
+	bool loadBrushCache(std::string cachename);
+	void writeBrushCache(std::string & data);
+	bool readBrushCache(const char* data, size_t size, std::string cachename);
+	uint64_t computeCacheKey();
+
+	void setLevelFile(blobCache::blob file);
+
+	// A brush of a .map file read back by readMap
+	struct sourceBrush {
+		int lo[3]; // in map units
+		int hi[3];
+		std::string shaders[6]; // x+, x-, y+, y-, z+, z-
+		int flags;
+		std::string text; // the brush as written, in case it is copied
+	};
+
+	// A .map file read back to be merged again
+	struct sourceMap {
+		vector<sourceBrush> brushes; // axis aligned worldspawn brushes on the block grid
+		vector< pair<std::string, std::string> > keys; // worldspawn keys but the classname
+		std::string brushText; // other worldspawn brushes, copied as they are
+		std::string entities;  // other entities, copied as they are
+		int lo[3]; // bounds of the brushes in blocks, hi is exclusive
+		int hi[3];
+	};
+
+	static bool readMap(std::string mapname, sourceMap & source);
+	void rasterizeMap(const sourceMap & source);
 
 private:
 	vector<mapBlock> m_BlockCollection;
 	vector < vector < vector<hintBrush> > > m_Hint3dArray;
+	int m_NumHints[3]; // size of m_Hint3dArray along x, y and z
+	occupancyPyramid m_Reached; // blocks reached by the flood fill, see checkBlockList
+
+	brickGrid m_Blocks;
+	brickGrid m_CheckList;
+	brickGrid m_TextureList;
+
+	// The world as runs of blocks in every column (x + y * m_Width), built
+	// when loading and kept up to date until the flood fill
+	vector<span> m_Spans;
+	vector<int> m_ColumnStart; // first span of every column, plus the end
 
-	vector < vector < vector<int> > > m_Blocks;
-	vector < vector < vector<int> > > m_TempBlocks;
-	vector < vector < vector<int> > > m_CheckList;
-	vector < vector < vector<int> > > m_TextureList;
+	std::string m_DatName;
+	vector<char> m_LevelData; // raw level data between readLevel and decodeLevel
+	blobCache::blob m_LevelFile; // the whole input file if the server has it, see setLevelFile
+
+	int m_WorldX;
+	int m_WorldY;
+	int m_WorldZ; // layers of the grids, m_LevelZ / m_Lod rounded up
+	int m_LevelZ; // layers of the level file
+
+	int m_Lod; // blocks of the world along every axis per block of the grids, 1 for full detail
 
 	int m_OffsetX;
 	int m_OffsetY;
@@ -245,35 +783,114 @@ private:
 
 	int m_HintSize;
 
-	struct MapBlockComparatorX {
-		bool operator()(const mapBlock & first, const mapBlock & second) {
-			return first.blck.x < second.blck.x;
-		}
-	} mapBlockComparatorX;
+	int m_Threads;
+
+	int m_MaxLights; // 0 for no light entities
+
+	int m_BlockSize; // _blocksize of worldspawn, 0 to leave it out
+	int m_ChopSize;  // chopsize of worldspawn, 0 to leave it out
 
-	struct MapBlockComparatorY {
-		bool operator()(const mapBlock & first, const mapBlock & second) {
-			return first.blck.y < second.blck.y;
+	bool m_FillHidden; // unreached blocks become Caulk instead of Air
+	bool m_DetailBrushes; // all brushes but the hints are detail, set by hints or by the source map
+
+	int m_CanopyBoxes; // boxes per trunk for the leaves of a tree, 0 to keep the leaves
+	bool m_MergeLiquids; // cover liquids with boxes, see mergeLiquids
+	bool m_ClipHull; // add clip boxes for player collision, see createClipHull
+
+	vector<mapBlock> m_Boxes; // built by simplifyFoliage, mergeLiquids and createClipHull, added by createBlockList
+
+	// What rasterizeMap could not turn into blocks, written as it was read
+	vector< pair<std::string, std::string> > m_SourceKeys;
+	std::string m_SourceBrushes;
+	std::string m_SourceEntities;
+
+	vector<lightEmitter> m_Emitters;
+	vector<light> m_Lights;
+
+	double m_Budget[numStages]; // seconds, 0 for no limit
+	double m_MergeDeadline;
+	progress m_Progress;
+
+	// Sort record for the merge kernels
+	struct mergeCandidate {
+		uint64_t key0;
+		uint64_t key1;
+		int position;
+		int index;
+
+		bool operator<(const mergeCandidate & other) const {
+			if (key0 != other.key0) return key0 < other.key0;
+			if (key1 != other.key1) return key1 < other.key1;
+			return position < other.position;
 		}
-	} mapBlockComparatorY;
 
-	struct MapBlockComparatorZ {
-		bool operator()(const mapBlock & first, const mapBlock & second) {
-			return first.blck.z > second.blck.z;
+		static bool byPosition(const mergeCandidate & first, const mergeCandidate & second) {
+			if (first.position != second.position) return first.position < second.position;
+			return first.index < second.index;
 		}
-	} mapBlockComparatorZ;
+	};
+
+	template <int AXIS> struct mergeTraits;
+
+	template <int AXIS> int mergeAxis();
 
-	char getBlockAtXYZ(char* arr, int x, int y, int z);
-	void setBlockAtXYZ(char* arr, int x, int y, int z, char ch);
+	char getBlockAtXYZ(brickGrid & grid, int x, int y, int z);
+	void setBlockAtXYZ(brickGrid & grid, int x, int y, int z, char ch);
 
-	void getTextures(int type, int texturing, string& xp_tex, string& xn_tex, string& yp_tex, string& yn_tex, string& zp_tex, string& zn_tex, int& blockflags);
+	bool isConverted(int type);
+	bool copyLevel();
+	void levelArea(int & width, int & length, int & height);
+	void downsampleLevel();
+	static int scaledSize(int size, int lod) { return (size + lod - 1) / lod; }
+	static bool isFoliage(int type);
+	bool isPlayerOpen(int x, int y, int z);
+	void buildReached();
+	bool isClipSlice(const int* lo, const int* hi);
+	static int liquidFamily(int type);
+
+	bool addLiquidSlice(const int* sliceLo, const int* sliceHi, const int* lo, const int* hi, int type,
+			brickGrid & taken, int & textured, int & hidden);
+
+	static bool parseBrush(const std::string & text, sourceBrush & brush);
+
+	void splitCanopy(vector<int> & cells, int first, int last, int boxes);
+
+	template <class layout>
+	void populateWorld(const char* leveldata, const layout & level);
+
+	void runLayers(bool write, int* counts, int* voxels);
+	void compactLayers(bool write, int* counts, int* voxels, std::atomic<int>* nextLayer);
+	template <bool WRITE>
+	int compactRow(int x0, int x1, int y, int z, mapBlock* out, int & voxels);
+	static int countNonZero(const unsigned char* bytes, int n);
+
+	void visitSpans(int column, int z0, int z1,
+			arenaVector< pair<int, int> >::type & checkList, arenaVector<char>::type & visited);
+	void computeExposure();
+	void loadExposureLayer(int z, unsigned char* plane);
+	int findSpan(int column, int z);
+	void appendSpan(vector<span> & spans, int columnStart, int z0, int z1, int type);
+
+	bool isHintVisible(int x, int y, int z);
+	void writeHintBrush(int x, int y, int z);
+	void writeLight(const light & l);
+	void beginMapFile(std::string mapname);
+	void endMapFile();
+	void writeWorldspawnKeys();
+	void addEmitter(int x, int y, int z, int type);
+	bool isEmitter(int type);
+
+	void getTextures(int type, int texturing, const char*& xp_tex, const char*& xn_tex, const char*& yp_tex, const char*& yn_tex, const char*& zp_tex, const char*& zn_tex, int& blockflags);
 
 	bool isSolid(int type);
 	bool isDetail(int type);
+	bool isLiquid(int type);
 
 	int worldSize();
 
 	ofstream m_OutFile;
+
+	arena m_Arena; // scratch memory of the passes
 };
 
 } /* namespace qine */